@@ -0,0 +1,300 @@
+// kbench: misura le prestazioni del compilatore kcomp su programmi sintetici.
+//
+//   kbench gen <forma> <n>       scrive su stdout un programma .k di dimensione n
+//   kbench run [opzioni]         compila la suite con kcomp --stats=json e riporta,
+//                                per ogni programma, righe/s, picco di memoria e tempo
+//                                per fase; con --baseline confronta i risultati con
+//                                quelli memorizzati e fallisce in caso di regressione
+//
+// Le forme disponibili sono elencate in shapes (più sotto).
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+/************************* Generatore di programmi *************************/
+// n funzioni indipendenti, ciascuna con un piccolo corpo
+static void genfunctions(std::ostream &os, int n) {
+  for (int k = 0; k < n; k++)
+    os << "def f" << k << "(x y) {\n  var t = x*y+" << k << ";\n"
+       << "  if (t < y) t = t+1 else t = t-1;\n  t - y/2\n};\n";
+}
+
+// Un'unica espressione annidata n volte
+static void gennesting(std::ostream &os, int n) {
+  const char ops[] = "+-*/";
+  std::string e = "x";
+  for (int k = 0; k < n; k++)
+    e = "(" + e + "\n" + ops[k % 4] + std::to_string(k % 7 + 1) + ")";
+  os << "def deep(x) " << e << ";\n";
+}
+
+// Un blocco con n istruzioni
+static void genblock(std::ostream &os, int n) {
+  os << "def block(x) {\n  var v0 = x";
+  for (int k = 1; k < n; k++)
+    os << ";\n  var v" << k << " = v" << k-1 << "*0.5+" << k;
+  os << ";\n  v" << n-1 << "\n};\n";
+}
+
+// n array globali, azzerati e sommati da una funzione
+static void genglobals(std::ostream &os, int n) {
+  for (int k = 0; k < n; k++)
+    os << "global g" << k << "[1024];\n";
+  os << "def touch() {\n  var s = 0";
+  for (int k = 0; k < n; k++)
+    os << ";\n  for (var i = 0; i < 1024; ++i) { g" << k << "[i] = i; s = s + g"
+       << k << "[i] }";
+  os << ";\n  s\n};\n";
+}
+
+// Funzioni con n parametri, chiamate con n argomenti
+static void genargs(std::ostream &os, int n) {
+  for (int f = 0; f < 10; f++) {
+    os << "def a" << f << "(";
+    for (int k = 0; k < n; k++)
+      os << (k ? "\n  p" : "p") << k;
+    os << ") p0";
+    for (int k = 1; k < n; k++)
+      os << "\n  +p" << k;
+    os << ";\n";
+  }
+  os << "def callargs(x) {\n  var s = 0";
+  for (int f = 0; f < 10; f++) {
+    os << ";\n  s = s + a" << f << "(";
+    for (int k = 0; k < n; k++)
+      os << (k ? ",\n    x+" : "x+") << k;
+    os << ")";
+  }
+  os << ";\n  s\n};\n";
+}
+
+// Un programma "realistico": cicli, condizioni e chiamate fra n funzioni
+static void genmixed(std::ostream &os, int n) {
+  os << "global A[1000];\n";
+  for (int k = 0; k < n; k++) {
+    os << "def m" << k << "(x) {\n"
+       << "  var acc = 0;\n"
+       << "  for (var i = 0; i < 1000; ++i) {\n"
+       << "    if (A[i] < x and not (i == " << k % 100 << ")) acc = acc + A[i]*" << k+1 << "\n"
+       << "    else A[i] = acc/" << k+2 << "\n"
+       << "  };\n";
+    if (k > 0)
+      os << "  acc = acc + m" << k-1 << "(x-1);\n";
+    os << "  acc\n};\n";
+  }
+}
+
+struct shape {
+  const char *name;
+  void (*gen)(std::ostream &, int);
+  int size;                     // Dimensione usata dalla suite di kbench run
+};
+
+static const shape shapes[] = {
+  {"functions", genfunctions, 5000},
+  {"nesting",   gennesting,   5000},
+  {"block",     genblock,     2000},
+  {"globals",   genglobals,   200},
+  {"args",      genargs,      1000},
+  {"mixed",     genmixed,     500},
+};
+
+/************************* Esecuzione di kcomp ****************************/
+// Valore numerico di un campo JSON (0 se assente)
+static double num(const json::Object *o, StringRef key) {
+  if (auto v = o->getNumber(key))
+    return *v;
+  return 0;
+}
+
+struct result {
+  std::string name;
+  long lines = 0;
+  double wall = 0;              // Tempo totale di kcomp (ms)
+  double cpu = 0;               // Tempo di CPU delle fasi di compilazione (ms)
+  double linespersec = 0;       // Calcolate sul tempo di CPU, meno sensibile al carico
+                                // della macchina rispetto al tempo reale
+  long rss = 0;                 // Picco di memoria residente (KB)
+  std::vector<std::pair<std::string, double>> phases;   // Tempo reale per fase (ms)
+};
+
+// Esegue kcomp con --stats=json e ne legge le statistiche
+static bool runkcomp(const std::string &cmd, result &r) {
+  FILE *p = popen(cmd.c_str(), "r");
+  if (!p) return false;
+  std::string out;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof buf, p)) > 0)
+    out.append(buf, n);
+  if (pclose(p) != 0) return false;
+  Expected<json::Value> v = json::parse(out);
+  if (!v) {
+    logAllUnhandledErrors(v.takeError(), errs(), "kbench: ");
+    return false;
+  }
+  json::Object *o = v->getAsObject();
+  r.wall = num(o, "wall_ms");
+  r.rss = num(o, "peak_rss_kb");
+  r.cpu = 0;
+  r.phases.clear();
+  if (json::Array *files = o->getArray("files"))
+    if (!files->empty())
+      if (json::Object *ph = (*files)[0].getAsObject()->getObject("phases"))
+        for (auto &kv : *ph) {
+          r.phases.emplace_back(kv.first.str(),
+                                num(kv.second.getAsObject(), "wall_ms"));
+          // Le fasi con il punto sono già comprese nella fase che le contiene
+          if (!StringRef(kv.first).contains('.'))
+            r.cpu += num(kv.second.getAsObject(), "cpu_ms");
+        }
+  std::sort(r.phases.begin(), r.phases.end());
+  return true;
+}
+
+static int usage() {
+  std::cerr << "uso: kbench gen <forma> <n>\n"
+               "     kbench run [--kcomp=PATH] [-O<n>] [--reps=R] [--scale=S]\n"
+               "                [--baseline=FILE] [--threshold=T] [--save=FILE]\n"
+               "forme:";
+  for (const shape &s : shapes) std::cerr << ' ' << s.name;
+  std::cerr << '\n';
+  return 2;
+}
+
+static const shape *findshape(const std::string &name) {
+  for (const shape &s : shapes)
+    if (name == s.name) return &s;
+  return nullptr;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) return usage();
+  std::string cmd = argv[1];
+
+  if (cmd == "gen") {
+    const shape *s = argc == 4 ? findshape(argv[2]) : nullptr;
+    if (!s) return usage();
+    s->gen(std::cout, atoi(argv[3]));
+    return 0;
+  }
+  if (cmd != "run") return usage();
+
+  std::string kcomp = "../kcomp", opt = "-O2", baseline, save;
+  int reps = 5;
+  double scale = 1, threshold = 0.10;
+  for (int i = 2; i < argc; i++) {
+    std::string a = argv[i];
+    if (a.rfind("--kcomp=", 0) == 0) kcomp = a.substr(8);
+    else if (a.rfind("-O", 0) == 0) opt = a;
+    else if (a.rfind("--reps=", 0) == 0) reps = std::max(1, atoi(a.c_str()+7));
+    else if (a.rfind("--scale=", 0) == 0) scale = atof(a.c_str()+8);
+    else if (a.rfind("--baseline=", 0) == 0) baseline = a.substr(11);
+    else if (a.rfind("--threshold=", 0) == 0) threshold = atof(a.c_str()+12);
+    else if (a.rfind("--save=", 0) == 0) save = a.substr(7);
+    else return usage();
+  }
+
+  std::vector<result> results;
+  for (const shape &s : shapes) {
+    result r;
+    r.name = s.name;
+    std::string file = std::string("kbench_") + s.name + ".k";
+    {
+      std::ostringstream src;
+      s.gen(src, std::max(1, (int) (s.size * scale)));
+      std::string text = src.str();
+      r.lines = std::count(text.begin(), text.end(), '\n');
+      std::ofstream(file) << text;
+    }
+    // Ogni programma viene compilato reps volte: si tiene l'esecuzione più veloce,
+    // la meno disturbata dal resto del sistema
+    std::vector<result> runs;
+    for (int k = 0; k < reps; k++) {
+      result one = r;
+      if (!runkcomp(kcomp + " " + opt + " --stats=json -o /dev/null " + file, one)) {
+        std::cerr << "kbench: compilazione di " << file << " fallita\n";
+        return 1;
+      }
+      runs.push_back(one);
+    }
+    r = *std::min_element(runs.begin(), runs.end(),
+                          [](const result &a, const result &b) { return a.cpu < b.cpu; });
+    r.linespersec = r.cpu > 0 ? r.lines / (r.cpu / 1000) : 0;
+    std::remove(file.c_str());
+    results.push_back(r);
+  }
+
+  outs() << formatv("{0,-10} {1,8} {2,12} {3,12} {4,12} {5,14}\n",
+                    "program", "lines", "wall (ms)", "CPU (ms)", "lines/s", "peak RSS (KB)");
+  for (const result &r : results) {
+    outs() << formatv("{0,-10} {1,8} {2,12:f2} {3,12:f2} {4,12:f0} {5,14}\n",
+                      r.name, r.lines, r.wall, r.cpu, r.linespersec, r.rss);
+    for (auto &ph : r.phases)
+      outs() << formatv("    {0,-20} {1,12:f2} ms\n", ph.first, ph.second);
+  }
+
+  json::Object current;
+  for (const result &r : results)
+    current[r.name] = json::Object{{"lines", (int64_t) r.lines},
+                                   {"wall_ms", r.wall},
+                                   {"cpu_ms", r.cpu},
+                                   {"lines_per_sec", r.linespersec},
+                                   {"peak_rss_kb", (int64_t) r.rss}};
+  if (!save.empty()) {
+    std::error_code EC;
+    raw_fd_ostream os(save, EC);
+    if (EC) {
+      std::cerr << "kbench: impossibile scrivere " << save << '\n';
+      return 1;
+    }
+    os << formatv("{0:2}", json::Value(json::Object{{"options", opt},
+                                                    {"results", std::move(current)}}))
+       << '\n';
+  }
+  if (baseline.empty())
+    return 0;
+
+  // Confronto con la baseline: è una regressione un calo di righe/s o una crescita
+  // del picco di memoria superiori alla soglia (frazione, 0.10 = 10%)
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(baseline);
+  if (!buf) {
+    std::cerr << "kbench: impossibile leggere " << baseline << '\n';
+    return 1;
+  }
+  Expected<json::Value> base = json::parse((*buf)->getBuffer());
+  if (!base) {
+    logAllUnhandledErrors(base.takeError(), errs(), "kbench: ");
+    return 1;
+  }
+  json::Object *bres = base->getAsObject() ? base->getAsObject()->getObject("results") : nullptr;
+  int regressions = 0;
+  outs() << formatv("\nbaseline {0}, threshold {1:P0}\n", baseline, threshold);
+  for (const result &r : results) {
+    json::Object *b = bres ? bres->getObject(r.name) : nullptr;
+    if (!b) {
+      outs() << formatv("{0,-10} not in baseline\n", r.name);
+      continue;
+    }
+    double blps = num(b, "lines_per_sec");
+    double brss = num(b, "peak_rss_kb");
+    double dlps = blps > 0 ? r.linespersec / blps - 1 : 0;
+    double drss = brss > 0 ? r.rss / brss - 1 : 0;
+    bool bad = dlps < -threshold || drss > threshold;
+    regressions += bad;
+    outs() << formatv("{0,-10} lines/s {1,8:P1}   peak RSS {2,8:P1}   {3}\n",
+                      r.name, dlps, drss, bad ? "REGRESSION" : "ok");
+  }
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+// rbench: misura la velocità del codice generato da kcomp.
+//
+// I kernel di kernels.k vengono eseguiti accanto a una versione C++ equivalente
+// (compilata con clang++ -O2) e per ciascuno si riportano minimo, mediana, media
+// e deviazione standard dei tempi su più ripetizioni, dopo alcune esecuzioni di
+// riscaldamento. Il livello di ottimizzazione dei kernel .k è quello con cui è
+// stato compilato kernels.k (vedi il Makefile, che produce rbench-O0 ... rbench-O3).
+//
+//   rbench [--reps=R] [--warmup=W] [--scale=S] [--label=L]
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+extern "C" {
+    double timens();             // Da time_and_print.cpp, disponibili anche ai .k
+    double ksort(double);        // Kernel compilati da kcomp
+    double ksqrt(double);
+    double kfibo(double);
+    double krand(double);
+    extern double V[];
+}
+
+/************************* Versioni C++ dei kernel *************************/
+static double B[100000];
+
+static double csort(double n) {
+  for (int i = 1; i < n; ++i) {
+    double pivot = B[i];
+    int j;
+    for (j = i-1; -1 < j && pivot < B[j]; --j)
+      B[j+1] = B[j];
+    B[j+1] = pivot;
+  }
+  return 0;
+}
+
+static double cerr(double a, double b) {
+  return a < b ? b-a : a-b;
+}
+
+static double citerate(double y, double x) {
+  double eps = 0.0001;
+  for (double z = x*x; eps < cerr(z, y); x = (x+y/x)/2) z = x*x;
+  return x;
+}
+
+static double csqrt1(double y) {
+  return y == 1 ? 1 : (y < 1 ? citerate(y, 1-y) : citerate(y, y/2));
+}
+
+static double csqrt(double n) {
+  double s = 0;
+  for (double i = 1; i < n+1; ++i) s = s + csqrt1(i);
+  return s;
+}
+
+static double cfibo1(double n) {
+  double a = 0, b = 1;
+  for (double i = 1; i < n; ++i) {
+    double oldb = b;
+    b = a+b;
+    a = oldb;
+  }
+  return b;
+}
+
+static double cfibo(double n) {
+  double s = 0;
+  for (double r = 0; r < n; ++r) s = s + cfibo1(r);
+  return s;
+}
+
+static double crand(double n) {
+  double a = 16897.0, m = 2147483647.0, seed = 1, s = 0;
+  for (double i = 0; i < n; ++i) {
+    double tmp = a*seed;
+    seed = tmp-m*std::floor(tmp/m);
+    s = s + seed/m;
+  }
+  return s;
+}
+
+/************************* Misura *************************/
+// Dati (pseudocasuali, sempre gli stessi) da ordinare, ricaricati prima di ogni esecuzione
+static void fill(double *A, int n) {
+  unsigned long x = 12345;
+  for (int i = 0; i < n; i++) {
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    A[i] = (double) (x >> 33);
+  }
+}
+
+struct kernel {
+  const char *name;
+  double (*k)(double);           // Versione kcomp
+  double (*c)(double);           // Versione C++
+  double n;                      // Dimensione del problema con --scale=1
+  double *data;                  // Array da ricaricare prima di ogni esecuzione (se c'è)
+  double *cdata;
+};
+
+struct stats {
+  double min, median, mean, stddev;
+  double result;
+};
+
+static stats measure(double (*f)(double), double n, double *data, int warmup, int reps) {
+  std::vector<double> t;
+  stats s;
+  for (int r = -warmup; r < reps; r++) {
+    if (data) fill(data, (int) n);
+    double start = timens();
+    s.result = f(n);
+    double elapsed = timens() - start;
+    if (data) s.result = data[0] + data[(int) n - 1];   // Controllo sull'array ordinato
+    if (r >= 0) t.push_back(elapsed);
+  }
+  std::sort(t.begin(), t.end());
+  s.min = t.front();
+  s.median = t.size() % 2 ? t[t.size()/2] : (t[t.size()/2-1] + t[t.size()/2]) / 2;
+  s.mean = 0;
+  for (double x : t) s.mean += x;
+  s.mean /= t.size();
+  s.stddev = 0;
+  for (double x : t) s.stddev += (x - s.mean) * (x - s.mean);
+  s.stddev = std::sqrt(s.stddev / t.size());
+  return s;
+}
+
+int main(int argc, char *argv[]) {
+  int reps = 10, warmup = 2;
+  double scale = 1;
+  std::string label = "kcomp";
+  for (int i = 1; i < argc; i++) {
+    std::string a = argv[i];
+    if (a.rfind("--reps=", 0) == 0) reps = std::max(1, atoi(a.c_str()+7));
+    else if (a.rfind("--warmup=", 0) == 0) warmup = std::max(0, atoi(a.c_str()+9));
+    else if (a.rfind("--scale=", 0) == 0) scale = atof(a.c_str()+8);
+    else if (a.rfind("--label=", 0) == 0) label = a.substr(8);
+    else {
+      fprintf(stderr, "uso: rbench [--reps=R] [--warmup=W] [--scale=S] [--label=L]\n");
+      return 2;
+    }
+  }
+
+  const kernel kernels[] = {
+    {"inssort", ksort, csort, 5000,    V,       B},
+    {"sqrt",    ksqrt, csqrt, 200000,  nullptr, nullptr},
+    {"fibo",    kfibo, cfibo, 1400,    nullptr, nullptr},
+    {"rand",    krand, crand, 1000000, nullptr, nullptr},
+  };
+
+  int res = 0;
+  printf("%-8s %-8s %12s %12s %12s %10s %12s %8s\n", label.c_str(), "kernel",
+         "min (us)", "median (us)", "mean (us)", "stddev", "C++ -O2 (us)", "ratio");
+  for (const kernel &k : kernels) {
+    double n = k.n * scale;
+    // L'array dei kernel .k ha 100000 elementi
+    if (k.data) n = std::min(n, 100000.0);
+    stats ks = measure(k.k, n, k.data, warmup, reps);
+    stats cs = measure(k.c, n, k.cdata, warmup, reps);
+    printf("%-8s %-8s %12.1f %12.1f %12.1f %9.1f%% %12.1f %7.2fx\n", label.c_str(), k.name,
+           ks.min / 1e3, ks.median / 1e3, ks.mean / 1e3, 100 * ks.stddev / ks.mean,
+           cs.median / 1e3, ks.median / cs.median);
+    // I due risultati devono coincidere, altrimenti il confronto non ha senso
+    if (ks.result != cs.result && !(std::isnan(ks.result) && std::isnan(cs.result))) {
+      fprintf(stderr, "%s: risultato diverso da C++ (%g invece di %g)\n",
+              k.name, ks.result, cs.result);
+      res = 1;
+    }
+  }
+  return res;
+}
@@ -1,11 +1,63 @@
 #include "driver.hpp"
 #include "parser.hpp"
-
-// Generazione di un'istanza per ciascuna della classi LLVMContext,
-// Module e IRBuilder. Nel caso di singolo modulo è sufficiente
-LLVMContext *context = new LLVMContext;
-Module *module = new Module("Kaleidoscope", *context);
-IRBuilder<> *builder = new IRBuilder(*context);
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/Reassociate.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Scalar/TailRecursionElimination.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Contesto, modulo e builder usati dai metodi codegen dei nodi dell'AST.
+// Ogni file sorgente ha un proprio driver, che possiede un'istanza di ciascuna
+// delle classi LLVMContext, Module e IRBuilder; i puntatori seguenti sono locali
+// al thread e vengono fatti puntare a quelle del driver che sta generando il codice
+// (si veda driver::codegen). In questo modo più file possono essere compilati in parallelo
+thread_local LLVMContext *context = nullptr;
+thread_local Module *module = nullptr;
+thread_local IRBuilder<> *builder = nullptr;
+
+// Allocatore degli array locali (karray.cpp) e supporto di --profile-generate
+// (kprofile.cpp), offerti da kcomp al codice eseguito con --run
+extern "C" void *karray_alloc(int64_t n, int64_t elemsize);
+extern "C" void karray_free(void *p, int64_t n, int64_t elemsize);
+extern "C" void kprof_register(const char *name, unsigned long long *c, long long n);
+extern "C" void kprof_dump();
 
 Value *LogErrorV(const std::string& Str) {
   std::cerr << Str << std::endl;
@@ -13,10 +65,11 @@ Value *LogErrorV(const std::string& Str) {
 }
 
 /* Il codice seguente sulle prime non è semplice da comprendere.
-   Esso definisce una utility (funzione C++) con due parametri:
-   1) la rappresentazione di una funzione llvm IR, e
-   2) il nome per un registro SSA
-   La chiamata di questa utility restituisce un'istruzione IR che alloca un double
+   Esso definisce una utility (funzione C++) con tre parametri:
+   1) la rappresentazione di una funzione llvm IR,
+   2) il nome per un registro SSA, e
+   3) il tipo (double, se omesso) della variabile
+   La chiamata di questa utility restituisce un'istruzione IR che alloca la variabile
    in memoria e ne memorizza il puntatore in un registro SSA cui viene attribuito
    il nome passato come secondo parametro. L'istruzione verrà scritta all'inizio
    dell'entry block della funzione passata come primo parametro.
@@ -24,50 +77,1637 @@ Value *LogErrorV(const std::string& Str) {
    interferire con il builder globale, la generazione viene dunque effettuata
    con un builder temporaneo TmpB
 */
-static AllocaInst *CreateEntryBlockAlloca(Function *fun, StringRef VarName) {
+static AllocaInst *CreateEntryBlockAlloca(Function *fun, StringRef VarName,
+                                          Type *T = nullptr) {
   IRBuilder<> TmpB(&fun->getEntryBlock(), fun->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(*context), nullptr, VarName);
+  return TmpB.CreateAlloca(T ? T : Type::getDoubleTy(*context), nullptr, VarName);
+}
+
+/************************* Tipi int e double ***********************/
+// Gli int sono interi con segno a 64 bit. Nelle espressioni miste un int viene
+// convertito in double; lo stesso accade quando un int è assegnato a una variabile
+// double (o passato a un parametro double, o restituito da una funzione double),
+// mentre nel verso opposto il double viene troncato
+Type *LLVMType(KType T) {
+  return T == KType::Int ? Type::getInt64Ty(*context) : Type::getDoubleTy(*context);
+}
+
+Value *ConvertToType(Value *V, Type *T) {
+  if (V->getType() == T)
+    return V;
+  if (T->isIntegerTy())
+    return builder->CreateFPToSI(V, T, "toint");
+  return builder->CreateSIToFP(V, T, "todouble");
+}
+
+// Valore di verità (i1) di un'espressione: vero se diversa da zero
+Value *CreateCondition(Value *V, const Twine &Name) {
+  if (V->getType()->isIntegerTy())
+    return builder->CreateICmpNE(V, ConstantInt::get(V->getType(), 0), Name);
+  return builder->CreateFCmpONE(V, ConstantFP::get(*context, APFloat(0.0)), Name);
+}
+
+// Le costanti numeriche del sorgente sono double. Una costante intera (es. 10
+// in i<10) che compare accanto a un int ne assume il tipo, in modo che l'intera
+// operazione venga eseguita sugli interi
+static bool isIntConstant(Value *V) {
+  ConstantFP *C = dyn_cast<ConstantFP>(V);
+  return C && C->getValueAPF().isInteger() &&
+         std::fabs(C->getValueAPF().convertToDouble()) < 9.2e18;
+}
+
+// Orologi usati per le statistiche: tempo reale e tempo di CPU del thread corrente
+// (in millisecondi), picco della memoria residente del processo (in KB)
+static double wallms() {
+  return std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpums() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long peakrss() {
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+phasetimer::phasetimer(driver &drv, const char *phase):
+  ps(drv.timing ? &drv.phases[phase] : nullptr), wall(0), cpu(0) {
+  if (ps) {
+    wall = wallms();
+    cpu = cpums();
+  }
+}
+
+phasetimer::~phasetimer() {
+  if (!ps) return;
+  ps->wall += wallms() - wall;
+  ps->cpu += cpums() - cpu;
+  ps->rss = std::max(ps->rss, peakrss());
+  ps->count++;
 }
 
 // Implementazione del costruttore della classe driver
-driver::driver(): trace_parsing(false), trace_scanning(false) {};
+driver::driver(): root(nullptr), trace_parsing(false), trace_scanning(false), optlevel(0),
+  outfile(""), emitkind(""), fold(true), hasint(false), assocmath(false), imports(nullptr),
+  inlinereport(false), lto(false), boundscheck(false), loopdepth(0), inlinechecks(0), checksinline(0),
+  checkshoisted(0), checksremoved(0), loopsversioned(0), stacklimit(16384), profgen(false), errors(0),
+  cache(nullptr), cached(false), functionscached(0), functionscompiled(0), interactive(false),
+  timing(false), timepasses(false), tokens(0), astnodes(0), scanwall(0),
+  profcounters(nullptr), profdata(nullptr), profnext(0) {};
+
+driver::~driver() {
+  free_ast();
+};
+
+// Rilascio dell'AST: i nodi vengono distrutti (in modo da liberare stringhe e vettori
+// che contengono) e la memoria dell'arena viene restituita in blocco. I figli di un
+// nodo sono nodi dell'arena a loro volta, per cui nessun distruttore li libera
+void driver::free_ast() {
+  for (RootAST *node : ASTNodes)
+    node->~RootAST();
+  ASTNodes.clear();
+  ASTArena.Reset();
+  root = nullptr;
+};
 
 // Implementazione del metodo parse
-int driver::parse (const std::string &f) {
+int driver::parse (const std::string &f, unsigned line) {
+  phasetimer t(*this, "parse");
   file = f;                    // File con il programma
-  location.initialize(&file);  // Inizializzazione dell'oggetto location
+  itemlocs.clear();
+  location.initialize(&file, line); // Inizializzazione dell'oggetto location
   scan_begin();                // Inizio scanning (ovvero apertura del file programma)
   yy::parser parser(*this);    // Istanziazione del parser
   parser.set_debug_level(trace_parsing); // Livello di debug del parsed
   int res = parser.parse();    // Chiamata dell'entry point del parser
   scan_end();                  // Fine scanning (ovvero chiusura del file programma)
+  if (timing) {                // Il tempo dello scanner è accumulato token per token
+    phasestats &ps = phases["parse.scan"];
+    ps.wall += scanwall;
+    ps.count++;
+    scanwall = 0;
+  }
   return res;
 }
 
+// yy_scan_buffer analizza il testo senza copiarlo, ma vuole che sia seguito da due byte
+// nulli e può scriverci (lo scanner pone temporaneamente uno 0 dopo ogni token). Un
+// file regolare viene perciò mappato in modo privato, con due byte in più, se questi
+// cadono ancora nella sua ultima pagina (che oltre la fine del file è azzerata);
+// altrimenti, come stdin, viene letto in un buffer allocato con i due byte nulli
+MutableArrayRef<char> driver::read_input(std::error_code &EC) {
+  if (inputmap)
+    return MutableArrayRef<char>(inputmap->data(), inputmap->size());
+  if (!inputcopy.empty())
+    return inputcopy;
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = std::error_code();
+  if (file.empty() || file == "-")
+    buf = MemoryBuffer::getSTDIN();
+  else {
+    int fd;
+    if ((EC = sys::fs::openFileForRead(file, fd)))
+      return {};
+    sys::fs::file_status st;
+    uint64_t page = sys::Process::getPageSizeEstimate();
+    if (!sys::fs::status(fd, st) && st.type() == sys::fs::file_type::regular_file &&
+        st.getSize() % page != 0 && st.getSize() % page <= page - 2) {
+      std::error_code MapEC;
+      inputmap = std::make_unique<sys::fs::mapped_file_region>(
+          sys::fs::convertFDToNativeFile(fd), sys::fs::mapped_file_region::priv,
+          st.getSize() + 2, 0, MapEC);
+      if (MapEC)
+        inputmap.reset();
+    }
+    if (!inputmap)
+      buf = MemoryBuffer::getOpenFile(sys::fs::convertFDToNativeFile(fd), file, -1, false);
+    sys::Process::SafelyCloseFileDescriptor(fd);
+    if (inputmap)
+      return MutableArrayRef<char>(inputmap->data(), inputmap->size());
+  }
+  if (!buf) {
+    EC = buf.getError();
+    return {};
+  }
+  inputcopy.reserve((*buf)->getBufferSize() + 2);
+  inputcopy.assign((*buf)->getBufferStart(), (*buf)->getBufferEnd());
+  inputcopy.insert(inputcopy.end(), 2, '\0');
+  return inputcopy;
+}
+
+void driver::release_input() {
+  inputmap.reset();
+  inputcopy = std::vector<char>();
+}
+
+// Il primo identificatore con un certo nome riceve l'id successivo (il numero dei
+// simboli già noti); quelli seguenti ritrovano la stessa voce della tabella
+symbol driver::intern(StringRef Name) {
+  return symbol(&*symbols.try_emplace(Name, symbols.size()).first);
+}
+
+// Un file .bc (per esempio scritto da kcomp --lto) prende il posto del sorgente:
+// il modulo viene letto nel contesto di questo driver, già pronto per link ed emissione
+int driver::load (const std::string &f) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(f);
+  if (!buf) {
+    std::cerr << "cannot open " << f << ": " << buf.getError().message() << '\n';
+    return 1;
+  }
+  return load(f, **buf);
+}
+
+int driver::load (const std::string &f, MemoryBufferRef buf) {
+  phasetimer t(*this, "load");
+  file = f;
+  TheContext = std::make_unique<LLVMContext>();
+  Expected<std::unique_ptr<Module>> M = parseBitcodeFile(buf, *TheContext);
+  if (!M) {
+    logAllUnhandledErrors(M.takeError(), errs(), "kcomp: " + f + ": ");
+    return 1;
+  }
+  TheModule = std::move(*M);
+  TheBuilder = std::make_unique<IRBuilder<>>(*TheContext);
+  context = TheContext.get();
+  module  = TheModule.get();
+  builder = TheBuilder.get();
+  init_passes();
+  return 0;
+}
+
+// Raccoglie le remark con cui l'inliner segnala ogni chiamata espansa (--inline-report),
+// indicando per le funzioni importate il file da cui provengono
+class inlineremarks : public DiagnosticHandler {
+  driver &drv;
+  const std::map<std::string, std::string> &imported;
+public:
+  inlineremarks(driver &drv, const std::map<std::string, std::string> &imported):
+    drv(drv), imported(imported) {};
+  bool isAnyRemarkEnabled() const override { return true; }
+  bool isPassedOptRemarkEnabled(StringRef PassName) const override {
+    return PassName == "inline";
+  }
+  bool handleDiagnostics(const DiagnosticInfo &DI) override {
+    const auto *R = dyn_cast<OptimizationRemark>(&DI);
+    if (!R || StringRef(R->getPassName()) != "inline")
+      return false;
+    std::string msg = R->getMsg();
+    for (const auto &A : R->getArgs())
+      if (A.Key == "Callee" && imported.count(A.Val))
+        msg += " [" + imported.at(A.Val) + "]";
+    drv.inlined.push_back(msg);
+    return true;
+  }
+};
+
 // Implementazione del metodo codegen, che è una "semplice" chiamata del 
 // metodo omonimo presente nel nodo root (il puntatore root è stato scritto dal parser)
-void driver::codegen() {
-  root->codegen(*this);
-  module->print(errs(), nullptr);
+// Prima della visita vengono creati contesto, modulo e builder propri di questo
+// driver, resi "correnti" per il thread chiamante
+int driver::codegen() {
+  TheBuilder.reset();          // Il modulo precedente va rilasciato prima del suo contesto
+  TheModule.reset();
+  TheContext = std::make_unique<LLVMContext>();
+  TheModule  = std::make_unique<Module>(file, *TheContext);
+  TheBuilder = std::make_unique<IRBuilder<>>(*TheContext);
+  context = TheContext.get();
+  module  = TheModule.get();
+  builder = TheBuilder.get();
+  if (inlinereport)
+    TheContext->setDiagnosticHandler(std::make_unique<inlineremarks>(*this, imported));
+  // Con --assoc-math somme e prodotti double possono essere riassociati (e il segno
+  // dello zero ignorato): è ciò che serve, fra l'altro, per trasformare in ciclo
+  // una ricorsione con accumulatore double come n*fact(n-1)
+  if (assocmath) {
+    FastMathFlags FMF;
+    FMF.setAllowReassoc();
+    FMF.setNoSignedZeros();
+    builder->setFastMathFlags(FMF);
+  }
+  init_passes();
+  imported.clear();
+  profiled.clear();
+  errors = 0;
+  if (!profuse.empty() && profile.empty())
+    read_profile();
+  if (fold) {
+    phasetimer t(*this, "fold");
+    root->fold(*this);
+  }
+  {
+    phasetimer t(*this, "codegen");
+    root->codegen(*this);
+    profile_module();
+  }
+  astnodes = ASTNodes.size();
+  free_ast();
+  if (errors)
+    return 1;
+  // Senza ottimizzazioni l'inliner non viene eseguito: importare non servirebbe
+  if (imports && optlevel > 0)
+    import_definitions();
+  optimize_module();
+  return 0;
 };
 
+// Emissione del codice. In assenza di -o e --emit l'IR testuale viene scritto su
+// stderr, come da sempre. Altrimenti il modulo in memoria viene scritto direttamente
+// nel formato richiesto: IR testuale (ll), bitcode (bc) oppure, tramite i passi di
+// backend della TargetMachine, assembly (asm) o file oggetto (obj). Se manca il nome
+// del file di uscita lo si ricava da quello del sorgente (x.k -> x.o, x.s, ...)
+void driver::output(std::string &kind, std::string &out) {
+  kind = emitkind;
+  out = outfile;
+  if (kind.empty()) {
+    StringRef ext = sys::path::extension(out);
+    kind = ext == ".ll" ? "ll" : ext == ".bc" ? "bc" : ext == ".s" ? "asm" : "obj";
+  }
+  if (out.empty()) {
+    SmallString<128> path(file);
+    sys::path::replace_extension(path, kind == "asm" ? "s" : kind == "obj" ? "o" : kind);
+    out = std::string(path);
+  }
+}
+
+int driver::emit() {
+  phasetimer t(*this, "emit");
+  if (emitkind.empty() && outfile.empty()) {
+    TheModule->print(errs(), nullptr);
+    return 0;
+  }
+  std::string kind, out;
+  output(kind, out);
+
+  std::error_code EC;
+  raw_fd_ostream dest(out, EC, kind == "ll" || kind == "asm" ? sys::fs::OF_Text
+                                                             : sys::fs::OF_None);
+  if (EC) {
+    std::cerr << "cannot open " << out << ": " << EC.message() << '\n';
+    return 1;
+  }
+  // Con la cache il risultato viene prima prodotto in memoria, per poterlo conservare
+  SmallVector<char, 0> buffer;
+  raw_svector_ostream mem(buffer);
+  raw_pwrite_stream &os = cache && !cachekey.empty() ? (raw_pwrite_stream &) mem : dest;
+  if (kind == "ll")
+    TheModule->print(os, nullptr);
+  else if (kind == "bc" && lto) {
+    // Il sommario (funzioni, riferimenti, chiamate) rende il bitcode utilizzabile
+    // anche dal linker in modalità ThinLTO, per esempio con clang++ -flto=thin
+    ProfileSummaryInfo PSI(*TheModule);
+    ModuleSummaryIndex Index = buildModuleSummaryIndex(*TheModule, nullptr, &PSI);
+    WriteBitcodeToFile(*TheModule, os, false, &Index);
+  }
+  else if (kind == "bc")
+    WriteBitcodeToFile(*TheModule, os);
+  else {
+    legacy::PassManager pass;
+    if (!target || target->addPassesToEmitFile(pass, os, nullptr,
+            kind == "asm" ? CGFT_AssemblyFile : CGFT_ObjectFile)) {
+      std::cerr << "Il target non supporta l'emissione di file " << kind << '\n';
+      return 1;
+    }
+    pass.run(*TheModule);
+  }
+  if (&os == &mem) {
+    dest << StringRef(buffer.data(), buffer.size());
+    cache->put(cachekey, StringRef(buffer.data(), buffer.size()));
+  }
+  dest.flush();
+  return 0;
+};
+
+// Un risultato trovato nella cache viene copiato nel file di uscita così com'è
+int driver::emit(StringRef data) {
+  phasetimer t(*this, "emit");
+  std::string kind, out;
+  output(kind, out);
+  std::error_code EC;
+  raw_fd_ostream dest(out, EC, sys::fs::OF_None);
+  if (EC) {
+    std::cerr << "cannot open " << out << ": " << EC.message() << '\n';
+    return 1;
+  }
+  dest << data;
+  return 0;
+};
+
+// Registrazione del target, una sola volta per processo
+static void inittarget() {
+  static std::once_flag targetinit;
+  std::call_once(targetinit, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+  });
+}
+
+/************************* Esecuzione JIT ****************************/
+// Le funzioni dichiarate extern vengono risolte fra i simboli del processo kcomp e,
+// nell'ordine, fra quelli delle librerie condivise indicate con --lib
+static std::unique_ptr<orc::LLJIT> createjit(const std::vector<std::string> &libs) {
+  ExitOnError ExitOnErr("kcomp: ");
+  inittarget();
+  std::unique_ptr<orc::LLJIT> jit = ExitOnErr(orc::LLJITBuilder().create());
+  orc::JITDylib &JD = jit->getMainJITDylib();
+  char prefix = jit->getDataLayout().getGlobalPrefix();
+  JD.addGenerator(ExitOnErr(
+      orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(prefix)));
+  for (const std::string &lib : libs)
+    JD.addGenerator(ExitOnErr(
+        orc::DynamicLibrarySearchGenerator::Load(lib.c_str(), prefix)));
+  // L'allocatore degli array locali grandi e la registrazione dei contatori del
+  // profilo sono quelli di karray.cpp e kprofile.cpp, collegati a kcomp
+  ExitOnErr(JD.define(orc::absoluteSymbols({
+      {jit->mangleAndIntern("karray_alloc"), JITEvaluatedSymbol::fromPointer(&karray_alloc)},
+      {jit->mangleAndIntern("karray_free"), JITEvaluatedSymbol::fromPointer(&karray_free)},
+      {jit->mangleAndIntern("kprof_register"), JITEvaluatedSymbol::fromPointer(&kprof_register)},
+      {jit->mangleAndIntern("kprof_dump"), JITEvaluatedSymbol::fromPointer(&kprof_dump)}})));
+  return jit;
+}
+
+// Il modulo viene ceduto a un LLJIT di ORC: da quel momento modulo e contesto
+// appartengono al JIT e i puntatori del thread vengono azzerati. Il valore
+// restituito da main diventa il codice di uscita
+int driver::run(const std::vector<std::string> &libs) {
+  ExitOnError ExitOnErr("kcomp: ");
+  std::unique_ptr<orc::LLJIT> jit = createjit(libs);
+  orc::JITDylib &JD = jit->getMainJITDylib();
+
+  Function *mainF = TheModule->getFunction("main");
+  bool intmain = mainF && mainF->getReturnType()->isIntegerTy();
+  TheBuilder.reset();
+  builder = nullptr;
+  module = nullptr;
+  context = nullptr;
+  ExitOnErr(jit->addIRModule(orc::ThreadSafeModule(std::move(TheModule),
+                                                   std::move(TheContext))));
+
+  phasetimer t(*this, "jit");    // La compilazione vera e propria avviene nella lookup
+  // Esecuzione dei costruttori del modulo (per esempio la registrazione dei
+  // contatori di --profile-generate)
+  ExitOnErr(jit->initialize(JD));
+  auto mainsym = jit->lookup("main");
+  if (!mainsym) {
+    logAllUnhandledErrors(mainsym.takeError(), errs(), "kcomp: ");
+    return 1;
+  }
+#if LLVM_VERSION_MAJOR >= 15
+  uint64_t mainaddr = mainsym->getValue();
+#else
+  uint64_t mainaddr = mainsym->getAddress();
+#endif
+  int res = intmain ? (int) ((int64_t (*)()) mainaddr)()   // def int main()
+                    : (int) ((double (*)()) mainaddr)();
+  // I contatori di --profile-generate stanno nella memoria del JIT: il profilo va
+  // scritto ora, non all'uscita del processo come per un eseguibile
+  if (profgen)
+    kprof_dump();
+  return res;
+};
+
+/******************************* REPL ********************************/
+// Sessione interattiva (--repl). Ogni elemento (def, extern, global o espressione,
+// terminato da ';' fuori da parentesi) diventa un modulo a sé, compilato e aggiunto
+// subito al JIT; un'espressione diventa il corpo di una funzione senza parametri,
+// che viene eseguita, ne stampa il valore e viene poi rimossa dal JIT.
+// Prima di ogni elemento vengono analizzate di nuovo, come extern e global, le
+// dichiarazioni degli elementi precedenti: nel nuovo modulo sono simboli esterni,
+// risolti dal JIT. Le funzioni definite nella sessione sono chiamate attraverso
+// uno stub, il cui puntatore viene aggiornato quando la funzione viene ridefinita:
+// le funzioni che la chiamano non vanno ricompilate (ma per questo la nuova
+// definizione deve avere lo stesso prototipo) e il modulo precedente viene rimosso
+
+// Dichiarazioni, nella sintassi del linguaggio, di una funzione e di una variabile
+// globale; la "firma" di una funzione ne ignora i nomi dei parametri
+static std::string typeprefix(KType T) {
+  return T == KType::Int ? "int " : "";
+}
+
+static std::string declaration(PrototypeAST *P, bool names = true) {
+  std::string D = "extern " + typeprefix(P->getRetType()) + P->getName().str() + "(";
+  for (const KParam &A : P->getArgs())
+    D += (&A == &P->getArgs()[0] ? "" : " ") + typeprefix(A.T) + (names ? A.Name.str() : "_") +
+         (A.Array ? "[]" : "");
+  return D + ");";
+}
+
+static std::string declaration(GlobalDeclAST *G) {
+  return "global " + typeprefix(G->getType()) + G->getName().str() +
+         (G->isArray() ? "[" + std::to_string(G->getArraySize()) + "]" : "") + ";";
+}
+
+#if LLVM_VERSION_MAJOR >= 15
+static uint64_t symaddr(orc::ExecutorAddr A) { return A.getValue(); }
+#else
+static uint64_t symaddr(JITEvaluatedSymbol S) { return S.getAddress(); }
+#endif
+
+int driver::repl(const std::vector<std::string> &files, const std::vector<std::string> &libs) {
+  interactive = true;
+  std::unique_ptr<orc::LLJIT> jit = createjit(libs);
+  orc::JITDylib &JD = jit->getMainJITDylib();
+  std::unique_ptr<orc::IndirectStubsManager> stubs =
+      orc::createLocalIndirectStubsManagerBuilder(jit->getTargetTriple())();
+  std::map<std::string, std::string> decls;  // Dichiarazioni degli elementi eseguiti
+  std::map<std::string, std::string> sigs;   // Firme delle funzioni dichiarate
+  std::map<std::string, orc::ResourceTrackerSP> defs; // Modulo di ogni funzione definita
+  unsigned version = 0;                      // Nomi delle definizioni: f.1, f.2, ...
+  auto failed = [](Error E) {
+    if (!E)
+      return false;
+    logAllUnhandledErrors(std::move(E), errs(), "kcomp: ");
+    return true;
+  };
+  // Il modulo di un elemento non riuscito va rilasciato prima del suo contesto
+  auto discard = [this] {
+    TheBuilder.reset();
+    TheModule.reset();
+    TheContext.reset();
+    builder = nullptr;
+    module = nullptr;
+    context = nullptr;
+  };
+
+  // Un elemento, che inizia alla riga line del file name
+  auto item = [&](const std::string &text, const std::string &name, unsigned line) {
+    size_t first = text.find_first_not_of(" \t\r\n;");
+    if (first == std::string::npos)
+      return;
+    free_ast();
+    prototypes.clear();
+    RootAST *before = nullptr;
+    std::string prelude;
+    for (auto &D : decls)
+      prelude += D.second + "\n";
+    if (!prelude.empty()) {
+      source = prelude;
+      int r = parse("<repl>");
+      source.clear();
+      if (r)
+        return;
+      before = root;
+    }
+    source = text;
+    int r = parse(name, line);
+    source.clear();
+    if (r)
+      return;
+
+    // Ciò che l'elemento dichiara va annotato prima del codegen, che rilascia l'AST
+    std::string declared, decl, sig;
+    bool expr = false, function = false, global = false;
+    for (RootAST *I : static_cast<SeqAST*>(root)->getItems()) {
+      PrototypeAST *P = dynamic_cast<PrototypeAST*>(I);
+      if (FunctionAST *F = dynamic_cast<FunctionAST*>(I)) {
+        P = F->getProto();
+        expr = P->getName().name() == "__kcomp.expr";
+        function = !expr;
+      }
+      if (P && !expr) {
+        declared = P->getName().str();
+        decl = declaration(P);
+        sig = declaration(P, false);
+      } else if (GlobalDeclAST *G = dynamic_cast<GlobalDeclAST*>(I)) {
+        declared = G->getName().str();
+        decl = declaration(G);
+        global = true;
+      }
+    }
+    if (!declared.empty() && decls.count(declared)) {
+      if (global || sigs[declared] != sig) {
+        if (decls[declared] != decl)
+          std::cerr << name << ":" << line + std::count(text.begin(), text.begin() + first, '\n')
+                    << ": " << declared
+                    << " è già dichiarata in modo diverso: " << decls[declared] << "\n";
+        return;
+      }
+      if (!function)             // Una extern già nota non aggiunge nulla
+        return;
+    }
+    if (before)
+      root = make<SeqAST>(std::vector<RootAST*>{before, root});
+
+    int err = codegen();
+    std::string defname = expr ? "__kcomp.expr" : declared;
+    if (expr || function) {
+      Function *F = TheModule->getFunction(defname);
+      if (err || !F || F->isDeclaration()) {
+        discard();               // Errore già segnalato dal codegen
+        return;
+      }
+      // La definizione ha un nome proprio: f resta il nome dello stub
+      if (function)
+        F->setName(defname = declared + "." + std::to_string(++version));
+    }
+    TheBuilder.reset();
+    builder = nullptr;
+    module = nullptr;
+    context = nullptr;
+    orc::ResourceTrackerSP RT = JD.createResourceTracker();
+    if (failed(jit->addIRModule(RT, orc::ThreadSafeModule(std::move(TheModule),
+                                                          std::move(TheContext)))))
+      return;
+    if (expr || function) {
+      auto sym = jit->lookup(defname);
+      if (!sym) {
+        failed(sym.takeError());
+        failed(RT->remove());
+        return;
+      }
+      uint64_t addr = symaddr(*sym);
+      if (expr) {
+        std::cout << ((double (*)()) addr)() << std::endl;
+        failed(RT->remove());
+        return;
+      }
+      if (defs.count(declared)) {
+        if (failed(stubs->updatePointer(declared, addr)))
+          return;
+        failed(defs[declared]->remove());
+      } else if (failed(stubs->createStub(declared, addr, JITSymbolFlags::Exported)) ||
+                 failed(JD.define(orc::absoluteSymbols(
+                     {{jit->mangleAndIntern(declared), stubs->findStub(declared, true)}})))) {
+        failed(RT->remove());
+        return;
+      }
+      defs[declared] = RT;
+    }
+    decls[declared] = decl;
+    if (global || function)
+      externals.insert(declared);
+    if (!global)
+      sigs[declared] = sig;
+  };
+
+  // Il testo viene diviso in elementi al primo ';' esterno a parentesi tonde,
+  // graffe e quadre (come quelli di un for o di un blocco)
+  std::string pending;
+  int depth = 0;
+  unsigned line = 1, start = 1;
+  auto feed = [&](const std::string &text, const std::string &name) {
+    for (char c : text) {
+      if (pending.empty())
+        start = line;
+      pending += c;
+      if (c == '\n')
+        line++;
+      else if (c == '(' || c == '{' || c == '[')
+        depth++;
+      else if ((c == ')' || c == '}' || c == ']') && depth > 0)
+        depth--;
+      else if (c == ';' && depth == 0) {
+        item(pending, name, start);
+        pending.clear();
+      }
+    }
+  };
+  // Alla fine del testo l'ultimo elemento può essere privo del ';'
+  auto finish = [&](const std::string &name) {
+    item(pending + ";", name, start);
+    pending.clear();
+    depth = 0;
+    line = 1;
+  };
+
+  for (const std::string &f : files) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(f);
+    if (!buf) {
+      std::cerr << "cannot open " << f << ": " << buf.getError().message() << '\n';
+      return 1;
+    }
+    feed(std::string((*buf)->getBuffer()), f);
+    finish(f);
+  }
+  bool tty = isatty(STDIN_FILENO);
+  std::string text;
+  while (true) {
+    if (tty)
+      std::cout << (pending.find_first_not_of(" \t\r\n") == std::string::npos ? "k> " : "... ")
+                << std::flush;
+    if (!std::getline(std::cin, text))
+      break;
+    feed(text + "\n", "<stdin>");
+  }
+  if (tty)
+    std::cout << std::endl;
+  finish("<stdin>");
+  return 0;
+}
+
+/******************** Compilazione incrementale ***********************/
+// Con --incremental ogni def del file è compilata (e ottimizzata) in un modulo a sé,
+// preceduto, come nel REPL, dalle dichiarazioni degli elementi precedenti che la
+// definizione nomina. La chiave del modulo nella cache è data dal testo della
+// definizione e da quello delle dichiarazioni e, dal livello -O1, dalle chiavi delle
+// funzioni chiamate, le cui definizioni vengono importate per l'inliner (come con
+// --import): modificare una def ricompila lei e le funzioni che la espandono, non le
+// altre. Le variabili globali vengono definite nel modulo del driver, a cui vengono
+// infine collegati i moduli di tutte le definizioni
+
+// Identificatori presenti nel testo di un elemento: oltre ai nomi degli elementi
+// precedenti vi sono parole chiave e variabili locali, che non nominano nulla
+static std::set<std::string> identifiers(StringRef text) {
+  std::set<std::string> ids;
+  size_t i = 0;
+  while (i < text.size()) {
+    size_t j = i + 1;
+    if (isAlpha(text[i])) {
+      while (j < text.size() && (isAlnum(text[j]) || text[j] == '_'))
+        j++;
+      ids.insert(text.substr(i, j - i).str());
+    } else if (isDigit(text[i]) || text[i] == '.')  // L'esponente di 1e5 non è un nome
+      while (j < text.size() && (isAlnum(text[j]) || text[j] == '.'))
+        j++;
+    i = j;
+  }
+  return ids;
+}
+
+int driver::compile_functions(const std::string &f, std::mutex &parsing,
+                              const std::vector<std::string> &keyparts) {
+  // Il testo del file, già letto per la chiave, viene copiato prima del parsing (che
+  // lo rilascia): le definizioni se ne ricavano dopo, una per una
+  file = f;
+  std::error_code EC;
+  MutableArrayRef<char> input = read_input(EC);
+  std::string text = EC ? "" : std::string(input.data(), input.size() - 2);
+  {
+    std::lock_guard<std::mutex> lock(parsing);
+    if (parse(f))
+      return 1;
+  }
+  // Posizioni (riga, colonna) delle location -> posizioni nel testo
+  std::vector<size_t> lines = {0};
+  for (size_t i = 0; i < text.size(); i++)
+    if (text[i] == '\n')
+      lines.push_back(i + 1);
+  auto offset = [&](const yy::position &P) {
+    return std::min(text.size(), lines[P.line - 1] + P.column - 1);
+  };
+  struct element {
+    std::string name, decl;     // Nome e dichiarazione (extern o global)
+    bool def, global;
+    size_t begin, end;          // Testo della definizione
+    yy::position pos;
+  };
+  std::vector<element> items;
+  const std::vector<RootAST*> &top = static_cast<SeqAST*>(root)->getItems();
+  for (size_t k = 0; k < top.size(); k++) {
+    element E{"", "", false, false, offset(itemlocs[k].begin), offset(itemlocs[k].end),
+              itemlocs[k].begin};
+    PrototypeAST *P = dynamic_cast<PrototypeAST*>(top[k]);
+    if (FunctionAST *F = dynamic_cast<FunctionAST*>(top[k])) {
+      P = F->getProto();
+      E.def = true;
+    }
+    if (P) {
+      E.name = P->getName().str();
+      E.decl = declaration(P);
+    } else if (GlobalDeclAST *G = dynamic_cast<GlobalDeclAST*>(top[k])) {
+      E.name = G->getName().str();
+      E.decl = declaration(G);
+      E.global = true;
+    }
+    items.push_back(E);
+  }
+
+  const std::vector<std::pair<std::string, std::string>> *fileimports = imports;
+  std::vector<std::string> code(items.size()), keys(items.size());
+  std::vector<bool> compiled(items.size());  // Def non prese dalla cache
+  std::map<std::string, size_t> declared;  // Ultimo elemento che dichiara un nome
+  int res = 0;
+  for (size_t k = 0; k < items.size(); k++) {
+    element &E = items[k];
+    if (!E.def) {
+      declared[E.name] = k;
+      continue;
+    }
+    // La definizione conserva la sua colonna, per i messaggi d'errore
+    std::string body = std::string(E.pos.column - 1, ' ') +
+                       text.substr(E.begin, E.end - E.begin) + ";";
+    std::set<size_t> deps;
+    for (const std::string &id : identifiers(body))
+      if (declared.count(id))
+        deps.insert(declared[id]);
+    std::string prelude;
+    std::set<std::string> ext;
+    std::vector<std::pair<std::string, std::string>> unitimports;
+    if (fileimports)
+      unitimports = *fileimports;
+    std::vector<StringRef> parts(keyparts.begin(), keyparts.end());
+    parts.push_back("function");
+    for (size_t d : deps) {
+      prelude += items[d].decl + "\n";
+      if (items[d].def || items[d].global)
+        ext.insert(items[d].name);
+      if (items[d].def && optlevel > 0 && !code[d].empty()) {
+        parts.push_back(keys[d]);
+        unitimports.emplace_back(items[d].name, code[d]);
+      }
+    }
+    parts.push_back(prelude);
+    parts.push_back(body);
+    keys[k] = cache->key(parts);
+    declared[E.name] = k;
+
+    if (std::unique_ptr<MemoryBuffer> hit = cache->get(keys[k])) {
+      code[k] = hit->getBuffer().str();
+      functionscached++;
+      continue;
+    }
+    free_ast();
+    prototypes.clear();
+    hasint = false;
+    externals = ext;
+    RootAST *before = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(parsing);
+      if (!prelude.empty()) {
+        source = prelude;
+        if (parse(f))
+          res = 1;
+        before = root;
+      }
+      source = body;
+      if (res || parse(f, E.pos.line))
+        res = 1;
+      source.clear();
+    }
+    if (res)
+      break;
+    if (before)
+      root = make<SeqAST>(std::vector<RootAST*>{before, root});
+    imports = unitimports.empty() ? nullptr : &unitimports;
+    int err = codegen();
+    imports = fileimports;
+    Function *F = TheModule->getFunction(E.name);
+    if (err || !F || F->isDeclaration()) {
+      res = 1;                   // Errore già segnalato dal codegen: le altre def
+      continue;                  // vengono comunque generate, per segnalarne gli errori
+    }
+    code[k] = bitcode();
+    compiled[k] = true;
+    functionscompiled++;
+  }
+  // Le def compilate entrano nella cache solo se tutto il file è riuscito
+  if (!res)
+    for (size_t k = 0; k < items.size(); k++)
+      if (compiled[k])
+        cache->put(keys[k], code[k]);
+
+  // Il modulo del driver definisce le variabili globali e riceve le definizioni
+  std::string globals = ";";
+  for (element &E : items)
+    if (E.global)
+      globals += E.decl;
+  free_ast();
+  prototypes.clear();
+  externals.clear();
+  {
+    std::lock_guard<std::mutex> lock(parsing);
+    source = globals;
+    if (!res && parse(f))
+      res = 1;
+    source.clear();
+  }
+  if (res)
+    return res;
+  imports = nullptr;
+  res = codegen();
+  imports = fileimports;
+  if (res)
+    return res;
+  phasetimer t(*this, "link");
+  Linker L(*TheModule);          // Uno solo per tutti i moduli, che sono molti
+  for (size_t k = 0; k < items.size(); k++) {
+    if (code[k].empty())
+      continue;
+    Expected<std::unique_ptr<Module>> M = parseBitcodeFile(
+        MemoryBufferRef(code[k], items[k].name), *TheContext);
+    if (!M) {
+      logAllUnhandledErrors(M.takeError(), errs(), "kcomp: " + f + ": ");
+      return 1;
+    }
+    if (L.linkInModule(std::move(*M)))
+      return 1;
+  }
+  return 0;
+}
+
+/********************** Cache di compilazione ***********************/
+// La versione entra in ogni chiave: un kcomp ricompilato (o un'altra versione di
+// LLVM) non riusa i risultati di quello precedente. Se la directory non può essere
+// creata la cache resta disattivata
+compilecache::compilecache(const std::string &d, uint64_t limit):
+  limit(limit), used(0), measured(false) {
+  if (std::error_code EC = sys::fs::create_directories(d)) {
+    std::cerr << "kcomp: cache " << d << " non disponibile: " << EC.message() << '\n';
+    return;
+  }
+  dir = d;
+  std::string exe = sys::fs::getMainExecutable("kcomp", (void *) &LogErrorV);
+  sys::fs::file_status st;
+  sys::fs::status(exe, st);
+  version = formatv("kcomp {0} {1} {2} LLVM {3}", exe, st.getSize(),
+                    st.getLastModificationTime().time_since_epoch().count(),
+                    LLVM_VERSION_STRING).str();
+}
+
+// Le parti sono precedute dalla loro lunghezza, così che nessuna concatenazione
+// diversa delle stesse stringhe produca la stessa chiave
+std::string compilecache::key(ArrayRef<StringRef> parts) const {
+  std::string all = version;
+  for (StringRef p : parts)
+    all += "\n" + std::to_string(p.size()) + ":" + p.str();
+  return toHex(SHA1::hash(arrayRefFromStringRef(all)), true);
+}
+
+std::unique_ptr<MemoryBuffer> compilecache::get(const std::string &key) const {
+  std::string path = dir + "/" + key;
+  int fd;
+  if (sys::fs::openFileForRead(path, fd))
+    return nullptr;
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf =
+    MemoryBuffer::getOpenFile(sys::fs::convertFDToNativeFile(fd), path, -1);
+  sys::fs::setLastAccessAndModificationTime(fd, std::chrono::system_clock::now());
+  sys::Process::SafelyCloseFileDescriptor(fd);
+  return buf ? std::move(*buf) : nullptr;
+}
+
+void compilecache::put(const std::string &key, StringRef data) const {
+  int fd;
+  SmallString<128> tmp;
+  if (sys::fs::createUniqueFile(dir + "/tmp-%%%%%%%%%%%%", fd, tmp))
+    return;
+  raw_fd_ostream os(fd, true);
+  os << data;
+  os.close();
+  if (os.has_error() || sys::fs::rename(tmp, dir + "/" + key)) {
+    os.clear_error();
+    sys::fs::remove(tmp);
+    return;
+  }
+  // La directory viene esaminata alla prima scrittura del processo; in seguito basta
+  // sommare le dimensioni delle voci scritte, finché non superano il limite
+  std::lock_guard<std::mutex> guard(lock);
+  used += data.size();
+  if (!measured || used > limit)
+    evict();
+}
+
+// Eliminazione delle voci usate meno di recente, finché la directory rientra nel
+// limite. I file temporanei più vecchi di un'ora sono resti di processi interrotti
+void compilecache::evict() const {
+  struct entry {
+    sys::TimePoint<> time;
+    uint64_t size;
+    std::string path;
+  };
+  std::vector<entry> entries;
+  uint64_t total = 0;
+  auto now = std::chrono::system_clock::now();
+  std::error_code EC;
+  for (sys::fs::directory_iterator it(dir, EC), end; it != end && !EC; it.increment(EC)) {
+    sys::fs::file_status st;
+    if (sys::fs::status(it->path(), st) || st.type() != sys::fs::file_type::regular_file)
+      continue;
+    if (sys::path::filename(it->path()).startswith("tmp-")) {
+      if (now - st.getLastModificationTime() > std::chrono::hours(1))
+        sys::fs::remove(it->path());
+      continue;
+    }
+    entries.push_back({st.getLastModificationTime(), st.getSize(), it->path()});
+    total += st.getSize();
+  }
+  measured = true;
+  used = total;
+  if (total <= limit)
+    return;
+  std::sort(entries.begin(), entries.end(),
+            [](const entry &a, const entry &b) { return a.time < b.time; });
+  for (const entry &e : entries) {
+    if (total <= limit)
+      break;
+    if (!sys::fs::remove(e.path))
+      total -= e.size;
+  }
+  used = total;
+}
+
+/*********************** Collegamento in memoria *********************/
+// Unisce al modulo di questo driver quello di other. Poiché i due moduli vivono
+// in contesti diversi (eventualmente riempiti da thread diversi), il modulo di
+// other viene serializzato in bitcode in memoria e riletto nel contesto di questo
+// driver prima di essere passato al Linker di LLVM
+int driver::link(driver &other) {
+  phasetimer t(*this, "link");
+  SmallVector<char, 0> buffer;
+  raw_svector_ostream os(buffer);
+  WriteBitcodeToFile(*other.TheModule, os);
+  Expected<std::unique_ptr<Module>> M = parseBitcodeFile(
+      MemoryBufferRef(StringRef(buffer.data(), buffer.size()), other.file), *TheContext);
+  if (!M) {
+    logAllUnhandledErrors(M.takeError(), errs(), "kcomp: ");
+    return 1;
+  }
+  // linkModules restituisce true in caso di errore (simboli definiti due volte, ...)
+  return Linker::linkModules(*TheModule, std::move(*M)) ? 1 : 0;
+};
+
+std::string driver::bitcode() {
+  std::string buffer;
+  raw_string_ostream os(buffer);
+  WriteBitcodeToFile(*TheModule, os);
+  return os.str();
+};
+
+/************************ Profilo dei salti ***************************/
+// I contatori di una funzione sono un array di i64: l'elemento 0 conta le chiamate,
+// gli elementi 2k+1 e 2k+2 le esecuzioni del k-esimo salto condizionato (nell'ordine
+// di generazione) e quante volte la sua condizione è vera. Il numero dei salti è noto
+// solo alla fine: durante la generazione gli incrementi usano un array segnaposto di
+// lunghezza 0, sostituito da profile_end con quello della dimensione giusta
+static void countadd(IRBuilder<> &B, GlobalVariable *C, unsigned k, Value *V) {
+  Value *P = B.CreateConstGEP2_64(C->getValueType(), C, 0, k);
+  B.CreateStore(B.CreateAdd(B.CreateLoad(B.getInt64Ty(), P), V), P);
+}
+
+void driver::profile_begin(Function *F) {
+  profnext = 0;
+  profcounters = nullptr;
+  profdata = nullptr;
+  if (profgen) {
+    profcounters = new GlobalVariable(*TheModule, ArrayType::get(builder->getInt64Ty(), 0),
+                                      false, GlobalValue::ExternalLinkage, nullptr);
+    countadd(*builder, profcounters, 0, builder->getInt64(1));
+  }
+  auto P = profile.find(std::string(F->getName()));
+  if (P != profile.end())
+    profdata = &P->second;
+}
+
+// Il conteggio precede il salto; i pesi vengono ridotti a 32 bit e aumentati di 1,
+// perché un ramo mai percorso nel profilo non diventi "impossibile"
+BranchInst *driver::profile_branch(BranchInst *BI) {
+  unsigned k = profnext++;
+  if (profcounters) {
+    IRBuilder<> B(BI);
+    countadd(B, profcounters, 2*k+1, B.getInt64(1));
+    countadd(B, profcounters, 2*k+2, B.CreateZExt(BI->getCondition(), B.getInt64Ty()));
+  }
+  if (profdata && 2*k+2 < profdata->size()) {
+    uint64_t total = (*profdata)[2*k+1];
+    uint64_t taken = std::min((*profdata)[2*k+2], total);
+    uint64_t scale = total / UINT32_MAX + 1;
+    BI->setMetadata(LLVMContext::MD_prof, MDBuilder(*context).createBranchWeights(
+        taken / scale + 1, (total - taken) / scale + 1));
+  }
+  return BI;
+}
+
+void driver::profile_end(Function *F) {
+  if (profcounters) {
+    if (F) {
+      ArrayType *T = ArrayType::get(builder->getInt64Ty(), 2*profnext + 1);
+      GlobalVariable *C = new GlobalVariable(*TheModule, T, false, GlobalValue::InternalLinkage,
+                                             ConstantAggregateZero::get(T),
+                                             "__kprof." + F->getName());
+      profcounters->replaceAllUsesWith(ConstantExpr::getBitCast(C, profcounters->getType()));
+      profiled.emplace_back(std::string(F->getName()), C);
+    }
+    profcounters->removeDeadConstantUsers();
+    profcounters->eraseFromParent();
+    profcounters = nullptr;
+  }
+  if (!profdata || !F)
+    return;
+  // Un numero di salti diverso da quello del profilo indica che il sorgente è
+  // cambiato: i conteggi non sono più attendibili e vengono scartati
+  if (profdata->size() != 2*profnext + 1) {
+    std::cerr << "kcomp: " << file << ": profilo di " << std::string(F->getName())
+              << " non valido (il sorgente è cambiato?), ignorato\n";
+    for (BasicBlock &BB : *F)
+      BB.getTerminator()->setMetadata(LLVMContext::MD_prof, nullptr);
+    return;
+  }
+  F->setEntryCount(Function::ProfileCount((*profdata)[0], Function::PCT_Real));
+}
+
+// Con --profile-generate un costruttore del modulo registra i contatori di ogni
+// funzione presso il supporto a tempo di esecuzione (kprofile.cpp), che li scrive
+// all'uscita del programma. Con --profile-use il modulo riceve il sommario del
+// profilo, con cui LLVM distingue le funzioni e le chiamate "calde" e "fredde"
+void driver::profile_module() {
+  if (!profiled.empty()) {
+    Type *CntTy = Type::getInt64PtrTy(*context);
+    FunctionCallee Reg = TheModule->getOrInsertFunction("kprof_register",
+        builder->getVoidTy(), builder->getInt8PtrTy(), CntTy, builder->getInt64Ty());
+    Function *Init = Function::Create(FunctionType::get(builder->getVoidTy(), false),
+                                      GlobalValue::InternalLinkage, "__kprof.init", *TheModule);
+    builder->SetInsertPoint(BasicBlock::Create(*context, "entry", Init));
+    for (auto &[name, C] : profiled)
+      builder->CreateCall(Reg, {builder->CreateGlobalStringPtr(name),
+                                builder->CreatePointerCast(C, CntTy),
+                                builder->getInt64(C->getValueType()->getArrayNumElements())});
+    builder->CreateRetVoid();
+    appendToGlobalCtors(*TheModule, Init, 0);
+  }
+  if (!profile.empty()) {
+    InstrProfSummaryBuilder PSB(ProfileSummaryBuilder::DefaultCutoffs.vec());
+    for (auto &P : profile)
+      PSB.addRecord(InstrProfRecord(P.second));
+    TheModule->setProfileSummary(PSB.getSummary()->getMD(*context), ProfileSummary::PSK_Instr);
+  }
+}
+
+// Il profilo è un file di testo scritto da kprofile.cpp: una riga per funzione con
+// nome, numero di contatori e contatori
+void driver::read_profile() {
+  std::ifstream in(profuse);
+  if (!in) {
+    std::cerr << "kcomp: impossibile leggere il profilo " << profuse << '\n';
+    return;
+  }
+  std::string name;
+  size_t n;
+  while (in >> name) {
+    if (name[0] == '#') {
+      std::getline(in, name);
+      continue;
+    }
+    if (!(in >> n))
+      break;
+    std::vector<uint64_t> &C = profile[name];
+    C.resize(n);
+    for (uint64_t &c : C)
+      in >> c;
+  }
+}
+
+/******************** Importazione fra moduli *************************/
+// Le definizioni delle funzioni che questo modulo dichiara soltanto (extern) vengono
+// copiate dai moduli importati con linkage available_externally: l'ottimizzatore
+// può espanderle inline o analizzarle, ma non le emette (la definizione vera resta
+// nel file oggetto dell'altro modulo e viene risolta dal linker). Il Linker, con
+// LinkOnlyNeeded, porta nel modulo solo ciò che è referenziato; le variabili globali
+// dell'altro modulo, che possono essere modificate, restano dichiarazioni esterne
+static bool referenceslocals(Function &F) {
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB)
+      for (Value *Op : I.operands())
+        if (auto *GV = dyn_cast<GlobalValue>(Op->stripPointerCasts()))
+          if (GV->hasLocalLinkage())
+            return true;
+  return false;
+}
+
+void driver::import_definitions() {
+  phasetimer t(*this, "import");
+  for (const auto &[name, code] : *imports) {
+    Expected<std::unique_ptr<Module>> M = parseBitcodeFile(
+        MemoryBufferRef(code, name), *TheContext);
+    if (!M) {
+      logAllUnhandledErrors(M.takeError(), errs(), "kcomp: " + name + ": ");
+      continue;
+    }
+    for (Function &F : **M) {
+      Function *Dest = TheModule->getFunction(F.getName());
+      if (F.isDeclaration())
+        continue;
+      // Solo funzioni esterne, dichiarate qui con lo stesso tipo, non già importate
+      // e che non usano simboli locali all'altro modulo (non accessibili da qui)
+      if (!F.hasExternalLinkage() || !Dest || !Dest->isDeclaration() ||
+          Dest->getFunctionType() != F.getFunctionType() ||
+          imported.count(std::string(F.getName())) || referenceslocals(F)) {
+        F.deleteBody();
+        continue;
+      }
+      F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+      imported[std::string(F.getName())] = name;
+    }
+    for (GlobalVariable &G : (*M)->globals())
+      if (!G.isDeclaration() && !G.hasLocalLinkage()) {
+        G.setInitializer(nullptr);
+        G.setLinkage(GlobalValue::ExternalLinkage);
+      }
+    if (Linker::linkModules(*TheModule, std::move(*M), Linker::Flags::LinkOnlyNeeded))
+      std::cerr << "kcomp: " << name << ": importazione non riuscita\n";
+  }
+};
+
+/************************** Ottimizzazione ***************************/
+// Predispone la TargetMachine dell'host (necessaria perché i passi, in particolare
+// i vettorizzatori, conoscano data layout e costi delle istruzioni) e i quattro
+// analysis manager del new pass manager, registrati e "collegati" fra loro dal PassBuilder.
+// Il FunctionPassManager contiene i passi applicati a ciascuna funzione appena generata:
+// mem2reg promuove in registri SSA le variabili allocate da CreateEntryBlockAlloca,
+// seguono le classiche semplificazioni locali (instcombine, reassociate, GVN, simplifycfg).
+// L'eliminazione della ricorsione in coda precede simplifycfg, che riunirebbe i return
+// dei rami di un ?: in un unico ret di un phi: con un ret per ramo anche n*f(n-1)
+// diventa un ciclo (con l'introduzione di un accumulatore)
+void driver::init_passes() {
+  // Un driver che genera un nuovo modulo (un elemento del REPL) riusa i pass manager,
+  // ma non le analisi del modulo precedente
+  if (PB) {
+    LAM->clear();
+    FAM->clear();
+    CGAM->clear();
+    MAM->clear();
+    if (target) {
+      TheModule->setTargetTriple(target->getTargetTriple().str());
+      TheModule->setDataLayout(target->createDataLayout());
+    }
+    return;
+  }
+  inittarget();
+  std::string triple = sys::getDefaultTargetTriple();
+  std::string err;
+  if (const Target *T = TargetRegistry::lookupTarget(triple, err)) {
+    target.reset(T->createTargetMachine(triple, "generic", "", TargetOptions(), Reloc::PIC_));
+    target->setOptLevel(optlevel == 0 ? CodeGenOpt::None :
+                        optlevel == 1 ? CodeGenOpt::Less :
+                        optlevel == 2 ? CodeGenOpt::Default : CodeGenOpt::Aggressive);
+    TheModule->setTargetTriple(triple);
+    TheModule->setDataLayout(target->createDataLayout());
+  } else
+    std::cerr << "Target non disponibile (" << err << "): ottimizzazioni generiche\n";
+
+  LAM  = std::make_unique<LoopAnalysisManager>();
+  FAM  = std::make_unique<FunctionAnalysisManager>();
+  CGAM = std::make_unique<CGSCCAnalysisManager>();
+  MAM  = std::make_unique<ModuleAnalysisManager>();
+  // Con le statistiche attive i passi vengono cronometrati tramite le callback
+  // di strumentazione del pass manager (i "passi" che contengono altri passi,
+  // come pass manager e adattori, sono esclusi per non contare due volte i tempi).
+  // Con --time-report si aggiunge il report standard di TimePassesHandler
+  if (timing) {
+    PIC = std::make_unique<PassInstrumentationCallbacks>();
+    PIC->registerBeforeNonSkippedPassCallback([this](StringRef P, Any) {
+      passstart.emplace_back(wallms(), cpums());
+    });
+    auto done = [this](StringRef P) {
+      std::pair<double, double> start = passstart.back();
+      passstart.pop_back();
+      if (isSpecialPass(P, {"PassManager", "PassAdaptor", "AnalysisManagerProxy",
+                            "DevirtSCCRepeatedPass", "ModuleInlinerWrapperPass"}))
+        return;
+      phasestats &ps = passes[P.str()];
+      ps.wall += wallms() - start.first;
+      ps.cpu += cpums() - start.second;
+      ps.count++;
+    };
+    PIC->registerAfterPassCallback(
+        [done](StringRef P, Any, const PreservedAnalyses &) { done(P); });
+    PIC->registerAfterPassInvalidatedCallback(
+        [done](StringRef P, const PreservedAnalyses &) { done(P); });
+    if (timepasses) {
+      TPH = std::make_unique<TimePassesHandler>(true);
+      TPH->registerCallbacks(*PIC);
+    }
+  }
+  PB.reset(new PassBuilder(target.get(), PipelineTuningOptions(), {}, PIC.get()));
+  PB->registerModuleAnalyses(*MAM);
+  PB->registerCGSCCAnalyses(*CGAM);
+  PB->registerFunctionAnalyses(*FAM);
+  PB->registerLoopAnalyses(*LAM);
+  PB->crossRegisterProxies(*LAM, *FAM, *CGAM, *MAM);
+
+  FPM = std::make_unique<FunctionPassManager>();
+  if (optlevel > 0) {
+    FPM->addPass(PromotePass());
+    FPM->addPass(InstCombinePass());
+    FPM->addPass(TailCallElimPass());
+    FPM->addPass(ReassociatePass());
+    FPM->addPass(GVNPass());
+    FPM->addPass(SimplifyCFGPass());
+  }
+}
+
+void driver::optimize_function(Function &F) {
+  if (optlevel == 0) return;
+  phasetimer t(*this, "codegen.optimize");
+  FPM->run(F, *FAM);
+}
+
+// La pipeline di default di LLVM per il livello richiesto (SROA, instcombine,
+// GVN, LICM, unrolling, vettorizzatori, ...). A -O0 il modulo resta com'è
+void driver::optimize_module() {
+  if (optlevel == 0) return;
+  phasetimer t(*this, "optimize.module");
+  OptimizationLevel level = optlevel == 1 ? OptimizationLevel::O1 :
+                            optlevel == 2 ? OptimizationLevel::O2 : OptimizationLevel::O3;
+  // Con --lto il modulo verrà ottimizzato di nuovo dopo il link: qui basta la
+  // pipeline "pre-link", che rimanda inlining e trasformazioni dei cicli più costose
+  ModulePassManager MPM = lto ? PB->buildThinLTOPreLinkDefaultPipeline(level)
+                              : PB->buildPerModuleDefaultPipeline(level);
+  MPM.run(*TheModule, *MAM);
+}
+
+// Tutto il programma è ora in questo modulo: i simboli diversi da main (e da quelli
+// richiesti con --export, usati da codice non .k) diventano interni, per cui l'inliner
+// li può espandere liberamente e GlobalDCE elimina le funzioni e le variabili che
+// nessuno usa più. Al link con clang++ restano da risolvere solo le funzioni esterne
+void driver::optimize_lto(const std::vector<std::string> &exports) {
+  phasetimer t(*this, "lto");
+  internalizeModule(*TheModule, [&](const GlobalValue &GV) {
+    return GV.getName() == "main" ||
+           std::find(exports.begin(), exports.end(), GV.getName()) != exports.end();
+  });
+  // Il modulo è stato modificato (dal Linker) fuori dal pass manager
+  MAM->invalidate(*TheModule, PreservedAnalyses::none());
+  ModulePassManager MPM;
+  if (optlevel == 0)
+    MPM.addPass(GlobalDCEPass());
+  else
+    MPM = PB->buildLTODefaultPipeline(optlevel == 1 ? OptimizationLevel::O1 :
+                                      optlevel == 2 ? OptimizationLevel::O2 :
+                                                      OptimizationLevel::O3, nullptr);
+  MPM.run(*TheModule, *MAM);
+}
+
+/************************** Statistiche ******************************/
+static json::Object tojson(const phasestats &ps) {
+  return json::Object{{"wall_ms", ps.wall}, {"cpu_ms", ps.cpu},
+                      {"peak_rss_kb", (int64_t) ps.rss}, {"count", ps.count}};
+}
+
+// Le statistiche del file, in forma di oggetto JSON (--stats=json)
+json::Value driver::stats() {
+  json::Object ph, pa, fn;
+  for (auto &p : phases)
+    ph[p.first] = tojson(p.second);
+  for (auto &p : passes)
+    pa[p.first] = tojson(p.second);
+  for (auto &f : functime)
+    fn[f.first] = f.second;
+  json::Object res{{"file", file},
+                   {"tokens", (int64_t) tokens},
+                   {"ast_nodes", (int64_t) astnodes},
+                   {"functions", (int64_t) functime.size()},
+                   {"phases", std::move(ph)},
+                   {"passes", std::move(pa)},
+                   {"function_codegen_ms", std::move(fn)}};
+  if (boundscheck)
+    res["bounds_checks"] = json::Object{{"inline", (int64_t) checksinline},
+                                        {"hoisted", (int64_t) checkshoisted},
+                                        {"removed", (int64_t) checksremoved},
+                                        {"versioned_loops", (int64_t) loopsversioned}};
+  if (cache)
+    res["cache"] = cached ? "hit" : "miss";
+  if (functionscached + functionscompiled)
+    res["incremental"] = json::Object{{"cached", (int64_t) functionscached},
+                                      {"compiled", (int64_t) functionscompiled}};
+  return res;
+}
+
+// Le stesse statistiche in forma leggibile (--time-report): le fasi, le funzioni
+// la cui generazione è stata più lenta e il report di TimePassesHandler
+void driver::time_report(raw_ostream &OS) {
+  OS << "===== kcomp time report: " << file << " =====\n";
+  OS << "tokens: " << tokens << ", AST nodes: " << astnodes
+     << ", functions: " << functime.size() << "\n";
+  if (boundscheck)
+    OS << "bounds checks: " << checksinline << " inline, " << checkshoisted
+       << " hoisted, " << checksremoved << " removed, " << loopsversioned
+       << " loops versioned\n";
+  if (cache)
+    OS << "cache: " << (cached ? "hit" : "miss") << "\n";
+  if (functionscached + functionscompiled)
+    OS << "functions: " << functionscompiled << " compiled, " << functionscached
+       << " from cache\n";
+  OS << "phase                   wall (ms)     cpu (ms)  peak RSS (KB)\n";
+  for (auto &p : phases)
+    OS << format("%-20s %12.3f %12.3f %14ld\n", p.first.c_str(),
+                 p.second.wall, p.second.cpu, p.second.rss);
+  std::vector<std::pair<std::string, double>> slowest(functime);
+  std::sort(slowest.begin(), slowest.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  if (slowest.size() > 10) slowest.resize(10);
+  if (!slowest.empty())
+    OS << "slowest functions (codegen ms):\n";
+  for (auto &f : slowest)
+    OS << format("  %-30s %10.3f\n", f.first.c_str(), f.second);
+  if (TPH) {
+    TPH->setOutStream(OS);
+    TPH->print();
+    TPH->setOutStream(errs());
+  }
+}
+
 /************************* Sequence tree **************************/
-SeqAST::SeqAST(RootAST* first, RootAST* continuation):
-  first(first), continuation(continuation) {};
+SeqAST::SeqAST(std::vector<RootAST*> items): items(std::move(items)) {};
 
-// La generazione del codice per una sequenza è banale:
-// mediante chiamate ricorsive viene generato il codice di first e 
-// poi quello di continuation (con gli opportuni controlli di "esistenza")
+// La generazione del codice per una sequenza è banale: viene generato,
+// nell'ordine, il codice di ciascun elemento. Il ciclo (al posto della ricorsione
+// su una catena di nodi) mantiene costante la profondità dello stack
+// qualunque sia la lunghezza del programma
 Value *SeqAST::codegen(driver& drv) {
-  if (first != nullptr) {
-    Value *f = first->codegen(drv);
-  } else {
-    if (continuation == nullptr) return nullptr;
-  }
-  Value *c = continuation->codegen(drv);
+  // Un elemento non riuscito (una sequenza annidata conta i propri) rende non valido
+  // il modulo
+  for (RootAST *item : items)
+    if (!item->codegen(drv) && !dynamic_cast<SeqAST*>(item))
+      drv.errors++;
   return nullptr;
 };
 
+/************************* Constant folding ***********************/
+// Prima del codegen l'AST viene semplificato: le sottoespressioni costanti sono
+// sostituite dal loro valore, i rami di if con condizione costante e i cicli for
+// la cui condizione è inizialmente falsa vengono eliminati. Ogni nodo semplifica
+// i propri figli e restituisce il nodo che deve prenderne il posto; i nuovi nodi
+// sono allocati, come gli altri, nell'arena del driver.
+// Il risultato deve coincidere esattamente con quello del codice non semplificato:
+// i confronti sono "unordered" (veri se un operando è NaN) come le fcmp ult/ueq
+// generate dal codegen, e non si semplifica x+0 (che vale +0 per x = -0)
+
+// Valore della costante rappresentata da E (se E è una costante)
+static bool isConst(ExprAST *E, double &V) {
+  NumberExprAST *N = dynamic_cast<NumberExprAST*>(E);
+  if (N) V = N->getVal();
+  return N;
+}
+
+static bool isValue(ExprAST *E, double V) {
+  double C;
+  return isConst(E, C) && C == V;
+}
+
+// Valore di verità di una costante, come in CreateCondition (fcmp one)
+static bool truth(double V) {
+  return !std::isnan(V) && V != 0;
+}
+
+RootAST *SeqAST::fold(driver& drv) {
+  for (RootAST *&item : items)
+    item = item->fold(drv);
+  return this;
+}
+
+RootAST *FunctionAST::fold(driver& drv) {
+  Body = Body->fold(drv);
+  return this;
+}
+
+VarBindingAST *VarBindingAST::fold(driver& drv) {
+  if (Val) Val = Val->fold(drv);
+  return this;
+}
+
+ArrayBindingAST *ArrayBindingAST::fold(driver& drv) {
+  Size = Size->fold(drv);
+  return this;
+}
+
+ExprAST *BinaryExprAST::fold(driver& drv) {
+  LHS = LHS->fold(drv);
+  RHS = RHS->fold(drv);
+  double L, R;
+  bool lconst = isConst(LHS, L), rconst = isConst(RHS, R);
+  // and/or: con il primo operando costante il secondo può non essere valutato
+  if (Op == 'a' && lconst && !truth(L))
+    return drv.make<NumberExprAST>(0.0);
+  if (Op == 'o' && lconst && truth(L))
+    return drv.make<NumberExprAST>(1.0);
+  if (lconst && rconst) {
+    switch (Op) {
+    case '+': return drv.make<NumberExprAST>(L + R);
+    case '-': return drv.make<NumberExprAST>(L - R);
+    case '*': return drv.make<NumberExprAST>(L * R);
+    case '/': return drv.make<NumberExprAST>(L / R);
+    case '<': return drv.make<NumberExprAST>(!(L >= R) ? 1.0 : 0.0);
+    case '=': return drv.make<NumberExprAST>(L == R || std::isnan(L) || std::isnan(R) ? 1.0 : 0.0);
+    case 'a': return drv.make<NumberExprAST>(truth(L) && truth(R) ? 1.0 : 0.0);
+    case 'o': return drv.make<NumberExprAST>(truth(L) || truth(R) ? 1.0 : 0.0);
+    }
+  }
+  // Identità esatte anche in virgola mobile (e valide per gli int):
+  // x*1, 1*x, x/1, x-0
+  if ((Op == '*' && isValue(RHS, 1.0)) || (Op == '/' && isValue(RHS, 1.0)) ||
+      (Op == '-' && isValue(RHS, 0.0) && !std::signbit(R)))
+    return LHS;
+  if (Op == '*' && isValue(LHS, 1.0))
+    return RHS;
+  return this;
+}
+
+ExprAST *UnaryExprAST::fold(driver& drv) {
+  // ++ e -- si applicano a variabili: non c'è nulla da semplificare
+  if (Op == 'p' || Op == 'm')
+    return this;
+  Operand = Operand->fold(drv);
+  double V;
+  if (isConst(Operand, V)) {
+    if (Op == '-') return drv.make<NumberExprAST>(-V);
+    if (Op == '!') return drv.make<NumberExprAST>(truth(V) ? 0.0 : 1.0);
+  }
+  return this;
+}
+
+ExprAST *CallExprAST::fold(driver& drv) {
+  for (ExprAST *&arg : Args)
+    arg = arg->fold(drv);
+  return this;
+}
+
+ExprAST *IfExprAST::fold(driver& drv) {
+  Cond = Cond->fold(drv);
+  TrueExp = TrueExp->fold(drv);
+  FalseExp = FalseExp->fold(drv);
+  // Il tipo del risultato dipende da entrambi i rami (double se uno dei due è
+  // double, int se uno è int e l'altro una costante intera): in presenza di int
+  // il ramo eliminato potrebbe cambiarlo, quindi si semplifica solo se il
+  // programma è tutto double, o se il ramo scelto è una costante non intera
+  // (il risultato è comunque double) oppure lo è anche l'altro
+  double C, V, W;
+  if (isConst(Cond, C)) {
+    ExprAST *Taken = truth(C) ? TrueExp : FalseExp;
+    ExprAST *Other = truth(C) ? FalseExp : TrueExp;
+    if (!drv.hasint ||
+        (isConst(Taken, V) && (V != std::trunc(V) || std::fabs(V) >= 9.2e18 ||
+                               isConst(Other, W))))
+      return Taken;
+  }
+  return this;
+}
+
+ExprAST *IfStmtAST::fold(driver& drv) {
+  Cond = Cond->fold(drv);
+  ThenBranch = ThenBranch->fold(drv);
+  if (ElseBranch) ElseBranch = ElseBranch->fold(drv);
+  // Un if-statement vale sempre 0.0: resta solo il ramo scelto, se c'è
+  double C;
+  if (isConst(Cond, C)) {
+    ExprAST *Taken = truth(C) ? ThenBranch : ElseBranch;
+    if (!Taken)
+      return drv.make<NumberExprAST>(0.0);
+    return drv.make<BlockExprAST>(std::vector<RootAST*>{ Taken },
+                                  drv.make<NumberExprAST>(0.0));
+  }
+  return this;
+}
+
+ExprAST *ForExprAST::fold(driver& drv) {
+  if (StartVar) StartVar = StartVar->fold(drv);
+  if (StartExpr) StartExpr = StartExpr->fold(drv);
+  Cond = Cond->fold(drv);
+  if (Step) Step = Step->fold(drv);
+  if (Body) Body = Body->fold(drv);
+  // Condizione costantemente falsa: il corpo non viene mai eseguito e resta
+  // soltanto l'inizializzazione (per i suoi eventuali effetti collaterali)
+  double C;
+  if (isConst(Cond, C) && !truth(C)) {
+    ExprAST *Init = StartVar ? StartVar->getVal() : StartExpr;
+    if (!Init)
+      return drv.make<NumberExprAST>(0.0);
+    return drv.make<BlockExprAST>(std::vector<RootAST*>{ Init },
+                                  drv.make<NumberExprAST>(0.0));
+  }
+  return this;
+}
+
+ExprAST *BlockExprAST::fold(driver& drv) {
+  // Le istruzioni ridotte a una costante non hanno effetti e vengono eliminate
+  std::vector<RootAST*> folded;
+  double V;
+  for (RootAST *S : Stmts) {
+    S = S->fold(drv);
+    ExprAST *E = dynamic_cast<ExprAST*>(S);
+    if (!E || !isConst(E, V))
+      folded.push_back(S);
+  }
+  Stmts = std::move(folded);
+  if (RetExpr) RetExpr = RetExpr->fold(drv);
+  return this;
+}
+
+/********************** Variabili modificate ***********************/
+// Usato dal controllo dei limiti degli array: un ciclo for il cui corpo non
+// modifica il contatore (né l'estremo) ne conosce l'intervallo. La visita è
+// prudente: anche una dichiarazione omonima, che nasconde la variabile, conta
+// come modifica. Le funzioni chiamate non possono modificare le variabili locali
+bool VarBindingAST::assigns(symbol N) const {
+  return Name == N || (Val && Val->assigns(N));
+}
+
+bool ArrayBindingAST::assigns(symbol N) const {
+  return Size->assigns(N);
+}
+
+bool BinaryExprAST::assigns(symbol Name) const {
+  return LHS->assigns(Name) || RHS->assigns(Name);
+}
+
+bool UnaryExprAST::assigns(symbol Name) const {
+  VariableExprAST *V = dynamic_cast<VariableExprAST*>(Operand);
+  if ((Op == 'p' || Op == 'm') && V && V->getName() == Name)
+    return true;
+  return Operand->assigns(Name);
+}
+
+bool CallExprAST::assigns(symbol Name) const {
+  for (ExprAST *arg : Args)
+    if (arg->assigns(Name)) return true;
+  return false;
+}
+
+bool IfExprAST::assigns(symbol Name) const {
+  return Cond->assigns(Name) || TrueExp->assigns(Name) || FalseExp->assigns(Name);
+}
+
+bool IfStmtAST::assigns(symbol Name) const {
+  return Cond->assigns(Name) || ThenBranch->assigns(Name) ||
+         (ElseBranch && ElseBranch->assigns(Name));
+}
+
+bool ForExprAST::assigns(symbol Name) const {
+  return (StartVar && StartVar->assigns(Name)) || (StartExpr && StartExpr->assigns(Name)) ||
+         Cond->assigns(Name) || (Step && Step->assigns(Name)) || (Body && Body->assigns(Name));
+}
+
+bool BlockExprAST::assigns(symbol Name) const {
+  for (RootAST *S : Stmts)
+    if (S->assigns(Name)) return true;
+  return RetExpr && RetExpr->assigns(Name);
+}
+
+/******************** Condizioni (salti diretti) *******************/
+// Caso generale: si calcola il valore dell'espressione e si salta secondo il
+// risultato del confronto con zero. Le sottoclassi per cui esiste un codice più
+// diretto (confronti, and, or, not) ridefiniscono il metodo
+Value *ExprAST::condcodegen(driver& drv, BasicBlock *TrueBB, BasicBlock *FalseBB) {
+  Value *V = codegen(drv);
+  if (!V)
+    return nullptr;
+  return drv.profile_branch(builder->CreateCondBr(CreateCondition(V, "cond"), TrueBB, FalseBB));
+}
+
+/******************* Posizione di coda (ricorsione) *******************/
+// Di default il valore dell'espressione viene restituito così com'è. Se è il
+// risultato di una chiamata, questa è una chiamata in coda: la si marca tail
+// (il chiamato non può accedere alla pila del chiamante, non ricevendo puntatori)
+// e, se è ricorsiva, musttail. In questo caso i tipi coincidono per costruzione,
+// la ret segue immediatamente la call e il back-end deve riusare il record di
+// attivazione anche a -O0: la ricorsione in coda usa pila costante
+Value *ExprAST::tailcodegen(driver& drv) {
+  Value *V = codegen(drv);
+  if (!V)
+    return nullptr;
+  Function *function = builder->GetInsertBlock()->getParent();
+  if (CallInst *CI = dyn_cast<CallInst>(V)) {
+    bool byvalue = true;
+    for (Value *A : CI->args())
+      byvalue &= !A->getType()->isPointerTy();
+    if (byvalue)
+      CI->setTailCallKind(CI->getCalledFunction() == function ?
+                          CallInst::TCK_MustTail : CallInst::TCK_Tail);
+  }
+  return builder->CreateRet(ConvertToType(V, function->getReturnType()));
+}
+
 /********************* Number Expression Tree *********************/
 NumberExprAST::NumberExprAST(double Val): Val(Val) {};
 
@@ -86,10 +1726,10 @@ Value *NumberExprAST::codegen(driver& drv) {
 };
 
 /******************** Variable Expression Tree ********************/
-VariableExprAST::VariableExprAST(const std::string &Name): Name(Name) {};
+VariableExprAST::VariableExprAST(symbol Name): Name(Name) {};
 
 lexval VariableExprAST::getLexVal() const {
-  lexval lval = Name;
+  lexval lval = Name.str();
   return lval;
 };
 
@@ -106,19 +1746,204 @@ lexval VariableExprAST::getLexVal() const {
 Value *VariableExprAST::codegen(driver& drv) {
   // 1) prova a leggere una variabile locale (allocata in entry block)
   if (AllocaInst *A = drv.NamedValues[Name]) {
-    return builder->CreateLoad(A->getAllocatedType(), A, Name.c_str());
+    return builder->CreateLoad(A->getAllocatedType(), A, Name.name());
   }
   // 2) poi prova tra le globali del modulo
-  if (GlobalVariable *GV = module->getGlobalVariable(Name)) {
+  if (GlobalVariable *GV = module->getGlobalVariable(Name.name())) {
     // GlobalVariable::getValueType() o getType()->getPointerElementType()
     Type *elemTy = GV->getValueType(); 
-    return builder->CreateLoad(elemTy, GV, Name.c_str());
+    return builder->CreateLoad(elemTy, GV, Name.name());
   }
   // se ancora niente, è davvero un errore
-  return LogErrorV("Variabile non definita: " + Name);
+  return LogErrorV("Variabile non definita: " + Name.str());
+}
+
+/***************** Array locali e parametri array *****************/
+// Array visibile con il nome Name: un array locale o un parametro array della
+// funzione, altrimenti un array globale
+static bool lookuparray(driver &drv, symbol Name, driver::arrayref &A) {
+  if (drv.arrays.count(Name)) {
+    A = drv.arrays[Name];
+    return true;
+  }
+  GlobalVariable *GV = module->getGlobalVariable(Name.name());
+  if (!GV || !GV->getValueType()->isArrayTy())
+    return false;
+  ArrayType *T = cast<ArrayType>(GV->getValueType());
+  A = driver::arrayref{GV, ConstantInt::get(Type::getInt64Ty(*context), T->getNumElements()),
+                       T->getElementType(), 0};
+  return true;
+}
+
+// Puntatore all'elemento di indice Idx (i64)
+static Value *arrayelement(const driver::arrayref &A, Value *Idx, const Twine &Name) {
+  if (GlobalVariable *GV = dyn_cast<GlobalVariable>(A.Ptr))
+    return builder->CreateGEP(GV->getValueType(), GV,
+                              {ConstantInt::get(Type::getInt64Ty(*context), 0), Idx}, Name);
+  return builder->CreateGEP(A.ElemTy, A.Ptr, Idx, Name);
+}
+
+// Allocatore degli array locali troppo grandi per la pila (karray.cpp):
+// karray_alloc(n, size) restituisce n elementi di size byte azzerati,
+// karray_free(p, n, size) li restituisce al pool del thread
+static FunctionCallee karrayfn(const char *Name) {
+  Type *I8P = Type::getInt8PtrTy(*context);
+  Type *I64 = Type::getInt64Ty(*context);
+  if (StringRef(Name) == "karray_alloc")
+    return module->getOrInsertFunction(Name, FunctionType::get(I8P, {I64, I64}, false));
+  return module->getOrInsertFunction(Name, FunctionType::get(Type::getVoidTy(*context),
+                                                             {I8P, I64, I64}, false));
+}
+
+ArrayBindingAST::ArrayBindingAST(symbol Name, ExprAST* Size, KType T):
+   Name(Name), Size(Size), T(T) {};
+
+// La memoria dell'array dipende dalla dimensione n:
+// - n costante, al più --stack-array-limit byte: un'area fissa nel record di
+//   attivazione, allocata nell'entry block come le variabili scalari;
+// - n costante maggiore del limite: lo heap, attraverso il pool di karray_alloc;
+// - n noto solo a tempo di esecuzione: si sceglie a tempo di esecuzione fra
+//   un'allocazione dinamica nella pila (alloca di n elementi, fra llvm.stacksave e
+//   llvm.stackrestore, così che un array dichiarato in un ciclo non faccia crescere
+//   la pila a ogni iterazione) e lo heap.
+// Gli elementi sono azzerati a ogni esecuzione della dichiarazione
+Value *ArrayBindingAST::codegen(driver& drv) {
+  Value *N = Size->codegen(drv);
+  if (!N)
+    return nullptr;
+  N = ConvertToType(N, builder->getInt64Ty());
+  Function *fun = builder->GetInsertBlock()->getParent();
+  Type *ElemTy = LLVMType(T);
+  uint64_t ElemSize = module->getDataLayout().getTypeAllocSize(ElemTy);
+  uint64_t Limit = drv.stacklimit / ElemSize;   // Massimo numero di elementi nella pila
+  driver::arrayscope S{Name, drv.arrays.count(Name) > 0, {}, nullptr, nullptr};
+  if (S.hadshadowed)
+    S.shadowed = drv.arrays[Name];
+  Value *Ptr;
+  ConstantInt *C = dyn_cast<ConstantInt>(N);
+  if (C && C->getSExtValue() < 0)
+    return LogErrorV("La dimensione dell'array " + Name.str() + " deve essere positiva");
+  if (C && C->getZExtValue() <= Limit) {
+    AllocaInst *A = CreateEntryBlockAlloca(fun, Name.name(), ArrayType::get(ElemTy, C->getZExtValue()));
+    builder->CreateMemSet(A, builder->getInt8(0), C->getZExtValue() * ElemSize, A->getAlign());
+    Ptr = builder->CreateConstGEP2_64(A->getAllocatedType(), A, 0, 0, Name.name());
+    S.OnStack = builder->getTrue();
+  } else if (C) {
+    Ptr = builder->CreateBitCast(
+        builder->CreateCall(karrayfn("karray_alloc"), {N, builder->getInt64(ElemSize)}),
+        ElemTy->getPointerTo(), Name.name());
+    S.OnStack = builder->getFalse();
+  } else {
+    // Un n negativo, come intero senza segno, supera il limite: karray_alloc lo rifiuta
+    S.StackSave = builder->CreateIntrinsic(Intrinsic::stacksave, {}, {}, nullptr, Name.name() + ".sp");
+    S.OnStack = builder->CreateICmpULE(N, builder->getInt64(Limit), Name.name() + ".onstack");
+    BasicBlock *StackBB = BasicBlock::Create(*context, Name.name() + ".stack", fun);
+    BasicBlock *HeapBB = BasicBlock::Create(*context, Name.name() + ".heap", fun);
+    BasicBlock *MergeBB = BasicBlock::Create(*context, Name.name() + ".ready", fun);
+    builder->CreateCondBr(S.OnStack, StackBB, HeapBB);
+    builder->SetInsertPoint(StackBB);
+    AllocaInst *A = builder->CreateAlloca(ElemTy, N, Name.name() + ".onstack");
+    A->setAlignment(Align(16));
+    builder->CreateMemSet(A, builder->getInt8(0),
+                          builder->CreateMul(N, builder->getInt64(ElemSize), Name.name() + ".bytes"),
+                          A->getAlign());
+    builder->CreateBr(MergeBB);
+    builder->SetInsertPoint(HeapBB);
+    Value *H = builder->CreateBitCast(
+        builder->CreateCall(karrayfn("karray_alloc"), {N, builder->getInt64(ElemSize)}),
+        ElemTy->getPointerTo());
+    builder->CreateBr(MergeBB);
+    builder->SetInsertPoint(MergeBB);
+    PHINode *PN = builder->CreatePHI(ElemTy->getPointerTo(), 2, Name.name());
+    PN->addIncoming(A, StackBB);
+    PN->addIncoming(H, HeapBB);
+    Ptr = PN;
+  }
+  drv.arrays[Name] = driver::arrayref{Ptr, N, ElemTy, drv.loopdepth};
+  drv.arrayscopes.push_back(S);
+  return Ptr;
+}
+
+// Rilascio degli array dichiarati dopo i primi scope elementi di drv.arrayscopes
+// (in ordine inverso di dichiarazione), che tornano invisibili
+static void releasearrays(driver &drv, size_t scope) {
+  while (drv.arrayscopes.size() > scope) {
+    driver::arrayscope &S = drv.arrayscopes.back();
+    driver::arrayref &A = drv.arrays[S.Name];
+    ConstantInt *OnStack = dyn_cast<ConstantInt>(S.OnStack);
+    Value *Args[] = {builder->CreateBitCast(A.Ptr, builder->getInt8PtrTy()), A.Size,
+                     builder->getInt64(module->getDataLayout().getTypeAllocSize(A.ElemTy))};
+    if (!OnStack)  {
+      Function *fun = builder->GetInsertBlock()->getParent();
+      BasicBlock *FreeBB = BasicBlock::Create(*context, S.Name.name() + ".free", fun);
+      BasicBlock *ContBB = BasicBlock::Create(*context, S.Name.name() + ".released", fun);
+      builder->CreateCondBr(S.OnStack, ContBB, FreeBB);
+      builder->SetInsertPoint(FreeBB);
+      builder->CreateCall(karrayfn("karray_free"), Args);
+      builder->CreateBr(ContBB);
+      builder->SetInsertPoint(ContBB);
+    } else if (OnStack->isZero())
+      builder->CreateCall(karrayfn("karray_free"), Args);
+    if (S.StackSave)
+      builder->CreateIntrinsic(Intrinsic::stackrestore, {}, {S.StackSave});
+    if (S.hadshadowed)
+      A = S.shadowed;
+    else
+      drv.arrays.erase(S.Name);
+    drv.arrayscopes.pop_back();
+  }
 }
 
 /******************** Binary Expression Tree **********************/
+// Se entrambi gli operandi sono int (o uno è int e l'altro una costante intera)
+// l'operazione è intera (e unifyOperands restituisce true): le operazioni
+// aritmetiche non ammettono overflow con segno (nsw), come in C, e la divisione
+// tronca verso zero. Altrimenti gli eventuali operandi int vengono convertiti in double
+static bool unifyOperands(Value *&L, Value *&R) {
+  Type *IntTy = Type::getInt64Ty(*context);
+  if (L->getType()->isIntegerTy() && isIntConstant(R))
+    R = ConvertToType(R, IntTy);
+  else if (R->getType()->isIntegerTy() && isIntConstant(L))
+    L = ConvertToType(L, IntTy);
+  if (L->getType()->isIntegerTy() && R->getType()->isIntegerTy())
+    return true;
+  L = ConvertToType(L, Type::getDoubleTy(*context));
+  R = ConvertToType(R, Type::getDoubleTy(*context));
+  return false;
+}
+
+// Confronto (Op è '<' oppure '=') fra operandi già unificati, come i1.
+// I confronti fra double sono "unordered": veri se uno degli operandi è NaN
+static Value *CreateCompare(char Op, Value *L, Value *R) {
+  if (L->getType()->isIntegerTy())
+    return Op == '<' ? builder->CreateICmpSLT(L, R, "cmptmp")
+                     : builder->CreateICmpEQ(L, R, "cmptmp");
+  return Op == '<' ? builder->CreateFCmpULT(L, R, "cmptmp")
+                   : builder->CreateFCmpUEQ(L, R, "cmptmp");
+}
+
+// and, or e not in posizione di valore (x = a and b): il valore di verità viene
+// calcolato da condcodegen, come per una condizione, con salti diretti fra gli
+// operandi; i due esiti confluiscono in un phi i1, convertito una sola volta in
+// double (0.0 o 1.0)
+static Value *boolvalue(driver &drv, ExprAST *E, const Twine &Name) {
+  Function *TheFunction = builder->GetInsertBlock()->getParent();
+  BasicBlock *TrueBB = BasicBlock::Create(*context, Name + ".true", TheFunction);
+  BasicBlock *FalseBB = BasicBlock::Create(*context, Name + ".false", TheFunction);
+  BasicBlock *MergeBB = BasicBlock::Create(*context, Name + ".cont", TheFunction);
+  if (!E->condcodegen(drv, TrueBB, FalseBB))
+    return nullptr;
+  builder->SetInsertPoint(TrueBB);
+  builder->CreateBr(MergeBB);
+  builder->SetInsertPoint(FalseBB);
+  builder->CreateBr(MergeBB);
+  builder->SetInsertPoint(MergeBB);
+  PHINode *PN = builder->CreatePHI(builder->getInt1Ty(), 2, Name);
+  PN->addIncoming(builder->getTrue(), TrueBB);
+  PN->addIncoming(builder->getFalse(), FalseBB);
+  return builder->CreateUIToFP(PN, builder->getDoubleTy(), "bool_to_double");
+}
+
 BinaryExprAST::BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS):
   Op(Op), LHS(LHS), RHS(RHS) {};
 
@@ -130,82 +1955,11 @@ BinaryExprAST::BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS):
 // In driver.cpp
 
 Value *BinaryExprAST::codegen(driver& drv) {
-  if (Op == 'a') { // Gestione di 'and' con short-circuiting
-      Value *L = LHS->codegen(drv);
-      if (!L) return nullptr;
-
-      // Converti LHS in booleano i1 (true se L != 0.0)
-      L = builder->CreateFCmpONE(L, ConstantFP::get(*context, APFloat(0.0)), "tobool_l_and");
-      
-      Function *TheFunction = builder->GetInsertBlock()->getParent();
-      
-      // Blocco per valutare RHS (solo se LHS è true)
-      BasicBlock *RHSBlock = BasicBlock::Create(*context, "rhs_and", TheFunction);
-      // Blocco dove il risultato di 'and' viene finalizzato
-      BasicBlock *MergeBlock = BasicBlock::Create(*context, "and_cont", TheFunction);
-
-      // Blocco corrente prima del branch (dove LHS è stato valutato)
-      BasicBlock *LHSBlock = builder->GetInsertBlock();
-      // Se L è true (1), vai a RHSBlock per valutare RHS.
-      // Se L è false (0), il risultato di 'and' è false, salta direttamente a MergeBlock.
-      builder->CreateCondBr(L, RHSBlock, MergeBlock);
-
-      // Codice per il blocco RHSBlock
-      builder->SetInsertPoint(RHSBlock);
-      Value *R = RHS->codegen(drv); // Valuta RHS
-      if (!R) return nullptr;
-      // Converti RHS in booleano i1
-      R = builder->CreateFCmpONE(R, ConstantFP::get(*context, APFloat(0.0)), "tobool_r_and");
-      builder->CreateBr(MergeBlock); // Salta al blocco di merge
-      // Aggiorna RHSBlock per il PHI node (è il blocco da cui arriviamo se RHS è stato valutato)
-      RHSBlock = builder->GetInsertBlock();
-
-      // Codice per il blocco MergeBlock
-      builder->SetInsertPoint(MergeBlock);
-      PHINode *PN = builder->CreatePHI(Type::getInt1Ty(*context), 2, "and_phi");
-      // Se arriviamo da LHSBlock (significa che L era false), il risultato di 'and' è false (0).
-      PN->addIncoming(ConstantInt::get(Type::getInt1Ty(*context), 0), LHSBlock);
-      // Se arriviamo da RHSBlock (significa che L era true), il risultato di 'and' è il valore di R.
-      PN->addIncoming(R, RHSBlock);
-      
-      // Converti il risultato booleano (i1) in double (0.0 o 1.0)
-      return builder->CreateUIToFP(PN, Type::getDoubleTy(*context), "bool_to_double");
-
-  } else if (Op == 'o') { // Gestione di 'or' con short-circuiting (codice esistente, verificato)
-      Value *L = LHS->codegen(drv);
-      if (!L) return nullptr;
-
-      // Converti LHS in booleano i1 (true se L != 0.0)
-      L = builder->CreateFCmpONE(L, ConstantFP::get(*context, APFloat(0.0)), "tobool_l_or");
-      
-      Function *TheFunction = builder->GetInsertBlock()->getParent();
-      
-      BasicBlock *RHSBlock = BasicBlock::Create(*context, "rhs_or", TheFunction);
-      BasicBlock *MergeBlock = BasicBlock::Create(*context, "or_cont", TheFunction);
-
-      BasicBlock *LHSBlock = builder->GetInsertBlock();
-      // Se L è true (1), il risultato di 'or' è true, salta direttamente a MergeBlock.
-      // Se L è false (0), vai a RHSBlock per valutare RHS.
-      builder->CreateCondBr(L, MergeBlock, RHSBlock);
-
-      builder->SetInsertPoint(RHSBlock);
-      Value *R = RHS->codegen(drv);
-      if (!R) return nullptr;
-      // Converti RHS in booleano i1
-      R = builder->CreateFCmpONE(R, ConstantFP::get(*context, APFloat(0.0)), "tobool_r_or");
-      builder->CreateBr(MergeBlock);
-      RHSBlock = builder->GetInsertBlock();
-
-      builder->SetInsertPoint(MergeBlock);
-      PHINode *PN = builder->CreatePHI(Type::getInt1Ty(*context), 2, "or_phi");
-      // Se arriviamo da LHSBlock (significa che L era true), il risultato di 'or' è true (1).
-      PN->addIncoming(ConstantInt::get(Type::getInt1Ty(*context), 1), LHSBlock);
-      // Se arriviamo da RHSBlock (significa che L era false), il risultato di 'or' è il valore di R.
-      PN->addIncoming(R, RHSBlock);
-      
-      // Converti il risultato booleano (i1) in double (0.0 o 1.0)
-      return builder->CreateUIToFP(PN, Type::getDoubleTy(*context), "bool_to_double");
-  }
+  // and e or con valutazione "short-circuit" (si veda boolvalue)
+  if (Op == 'a')
+    return boolvalue(drv, this, "and");
+  if (Op == 'o')
+    return boolvalue(drv, this, "or");
 
   // Codice per tutti gli altri operatori binari (aritmetici e di comparazione)
   // Questi vengono valutati solo se Op non è 'a' (and) o 'o' (or)
@@ -214,35 +1968,71 @@ Value *BinaryExprAST::codegen(driver& drv) {
   if (!L || !R_val) 
      return nullptr;
 
-  switch (Op) {
-  case '+':
-    return builder->CreateFAdd(L,R_val,"addres");
-  case '-':
-    return builder->CreateFSub(L,R_val,"subres");
-  case '*':
-    return builder->CreateFMul(L,R_val,"mulres");
-  case '/':
-    return builder->CreateFDiv(L,R_val,"addres");
-  case '<':
-    L = builder->CreateFCmpULT(L,R_val,"cmptmp");
-    // Converti il risultato booleano (i1) in double (0.0 o 1.0)
-    return builder->CreateUIToFP(L, Type::getDoubleTy(*context), "booltmp");
-  case '=': // Assumendo che '=' sia per '==' come da token EQ
-    L = builder->CreateFCmpUEQ(L,R_val,"cmptmp");
+  if (unifyOperands(L, R_val)) {
+    switch (Op) {
+    case '+':
+      return builder->CreateNSWAdd(L,R_val,"addres");
+    case '-':
+      return builder->CreateNSWSub(L,R_val,"subres");
+    case '*':
+      return builder->CreateNSWMul(L,R_val,"mulres");
+    case '/':
+      return builder->CreateSDiv(L,R_val,"divres");
+    }
+  } else {
+    switch (Op) {
+    case '+':
+      return builder->CreateFAdd(L,R_val,"addres");
+    case '-':
+      return builder->CreateFSub(L,R_val,"subres");
+    case '*':
+      return builder->CreateFMul(L,R_val,"mulres");
+    case '/':
+      return builder->CreateFDiv(L,R_val,"addres");
+    }
+  }
+  if (Op == '<' || Op == '=') {
     // Converti il risultato booleano (i1) in double (0.0 o 1.0)
+    L = CreateCompare(Op, L, R_val);
     return builder->CreateUIToFP(L, Type::getDoubleTy(*context), "booltmp");
-  default:  
-    return LogErrorV("Operatore binario non supportato: " + std::string(1, Op));
   }
+  return LogErrorV("Operatore binario non supportato: " + std::string(1, Op));
 };
 
+// Quando l'espressione è una condizione (di if, ?: o for) non serve calcolarne il
+// valore double: and e or diventano salti fra i blocchi dei due operandi, not
+// scambia le destinazioni e ogni confronto produce direttamente il salto.
+// Ad esempio -1<j and pivot<A[j] diventa due confronti e due salti condizionati
+Value *BinaryExprAST::condcodegen(driver& drv, BasicBlock *TrueBB, BasicBlock *FalseBB) {
+  if (Op == 'a' || Op == 'o') {
+    Function *TheFunction = builder->GetInsertBlock()->getParent();
+    BasicBlock *RHSBlock = BasicBlock::Create(*context, Op == 'a' ? "rhs_and" : "rhs_or",
+                                              TheFunction, TrueBB);
+    // and: se LHS è falso lo è anche il risultato; or: se LHS è vero lo è il risultato
+    if (!(Op == 'a' ? LHS->condcodegen(drv, RHSBlock, FalseBB)
+                    : LHS->condcodegen(drv, TrueBB, RHSBlock)))
+      return nullptr;
+    builder->SetInsertPoint(RHSBlock);
+    return RHS->condcodegen(drv, TrueBB, FalseBB);
+  }
+  if (Op == '<' || Op == '=') {
+    Value *L = LHS->codegen(drv);
+    Value *R = RHS->codegen(drv);
+    if (!L || !R)
+      return nullptr;
+    unifyOperands(L, R);
+    return drv.profile_branch(builder->CreateCondBr(CreateCompare(Op, L, R), TrueBB, FalseBB));
+  }
+  return ExprAST::condcodegen(drv, TrueBB, FalseBB);
+}
+
 /********************* Call Expression Tree ***********************/
 /* Call Expression Tree */
-CallExprAST::CallExprAST(std::string Callee, std::vector<ExprAST*> Args):
+CallExprAST::CallExprAST(symbol Callee, std::vector<ExprAST*> Args):
   Callee(Callee),  Args(std::move(Args)) {};
 
 lexval CallExprAST::getLexVal() const {
-  lexval lval = Callee;
+  lexval lval = Callee.str();
   return lval;
 };
 
@@ -252,12 +2042,14 @@ Value* CallExprAST::codegen(driver& drv) {
   // il cui nome coincide con il nome memorizzato nel nodo dell'AST
   // Se la funzione non viene trovata (e dunque non è stata precedentemente definita)
   // viene generato un errore
-  Function *CalleeF = module->getFunction(Callee);
+  Function *CalleeF = module->getFunction(Callee.name());
   if (!CalleeF)
      return LogErrorV("Funzione non definita");
   // Il secondo controllo è che la funzione recuperata abbia tanti parametri
-  // quanti sono gi argomenti previsti nel nodo AST
-  if (CalleeF->arg_size() != Args.size())
+  // quanti sono gi argomenti previsti nel nodo AST (un parametro array ne
+  // occupa due nella funzione LLVM, si veda PrototypeAST::codegen)
+  PrototypeAST *P = drv.prototypes.lookup(Callee);
+  if ((P ? P->getArgs().size() : CalleeF->arg_size()) != Args.size())
      return LogErrorV("Numero di argomenti non corretto");
   // Passato con successo anche il secondo controllo, viene predisposta
   // ricorsivamente la valutazione degli argomenti presenti nella chiamata 
@@ -266,11 +2058,32 @@ Value* CallExprAST::codegen(driver& drv) {
   // vengono inseriti in un vettore, dove "se li aspetta" il metodo CreateCall
   // del builder, che viene chiamato subito dopo per la generazione dell'istruzione
   // IR di chiamata
+  // Ogni argomento viene convertito, se necessario, nel tipo del parametro
+  // Un array è passato per riferimento: l'argomento deve essere il nome di un
+  // array (globale, locale o parametro) con elementi del tipo del parametro
   std::vector<Value *> ArgsV;
-  for (auto arg : Args) {
-     ArgsV.push_back(arg->codegen(drv));
-     if (!ArgsV.back())
+  for (size_t k = 0; k < Args.size(); k++) {
+     ExprAST *arg = Args[k];
+     if (P && P->getArgs()[k].Array) {
+        VariableExprAST *Var = dynamic_cast<VariableExprAST*>(arg);
+        driver::arrayref A;
+        if (!Var || !lookuparray(drv, Var->getName(), A))
+           return LogErrorV("Il parametro " + P->getArgs()[k].Name.str() + " di " + Callee.str() +
+                            " richiede un array");
+        if (A.ElemTy != LLVMType(P->getArgs()[k].T))
+           return LogErrorV("Tipo degli elementi di " + Var->getName().str() +
+                            " diverso da quello del parametro " + P->getArgs()[k].Name.str());
+        if (isa<GlobalVariable>(A.Ptr))
+           A.Ptr = builder->CreateConstGEP2_64(cast<GlobalVariable>(A.Ptr)->getValueType(),
+                                               A.Ptr, 0, 0);
+        ArgsV.push_back(A.Ptr);
+        ArgsV.push_back(A.Size);
+        continue;
+     }
+     Value *V = arg->codegen(drv);
+     if (!V)
         return nullptr;
+     ArgsV.push_back(ConvertToType(V, CalleeF->getArg(ArgsV.size())->getType()));
   }
   return builder->CreateCall(CalleeF, ArgsV, "calltmp");
 }
@@ -281,14 +2094,6 @@ IfExprAST::IfExprAST(ExprAST* Cond, ExprAST* TrueExp, ExprAST* FalseExp):
    
 // In driver.cpp - IfExprAST::codegen
 Value* IfExprAST::codegen(driver& drv) {
-    
-    Value* CondV = Cond->codegen(drv);
-    if (!CondV)
-        return nullptr;
-
-    // Modifica la stringa qui:
-    CondV = builder->CreateFCmpONE(CondV, ConstantFP::get(*context, APFloat(0.0)), "ifcond_ULTRA_DEBUG"); 
-
     Function *function = builder->GetInsertBlock()->getParent();
 
     // Modifica anche un nome di blocco per sicurezza:
@@ -296,7 +2101,8 @@ Value* IfExprAST::codegen(driver& drv) {
     BasicBlock *FalseBB = BasicBlock::Create(*context, "falseexp_DBG", function); 
     BasicBlock *MergeBB = BasicBlock::Create(*context, "endcond_DBG", function);  
 
-    builder->CreateCondBr(CondV, TrueBB, FalseBB);
+    if (!Cond->condcodegen(drv, TrueBB, FalseBB))
+        return nullptr;
 
     builder->SetInsertPoint(TrueBB);
     Value *TrueVal = TrueExp->codegen(drv);
@@ -310,24 +2116,92 @@ Value* IfExprAST::codegen(driver& drv) {
     builder->CreateBr(MergeBB);
     FalseBB = builder->GetInsertBlock(); 
 
+    // Il risultato è int se lo sono entrambi i rami, o se uno è int e l'altro è una
+    // costante intera (come in n < 2 ? 1 : n*f(n-1)), adottata come per gli operatori
+    // binari; altrimenti il ramo int viene convertito in double prima del salto
+    Type *ResTy = TrueVal->getType();
+    if (ResTy->isIntegerTy() && isIntConstant(FalseVal))
+        FalseVal = ConvertToType(FalseVal, ResTy);
+    else if (FalseVal->getType()->isIntegerTy() && isIntConstant(TrueVal))
+        TrueVal = ConvertToType(TrueVal, ResTy = FalseVal->getType());
+    if (FalseVal->getType() != ResTy) {
+        ResTy = Type::getDoubleTy(*context);
+        builder->SetInsertPoint(TrueBB->getTerminator());
+        TrueVal = ConvertToType(TrueVal, ResTy);
+        builder->SetInsertPoint(FalseBB->getTerminator());
+        FalseVal = ConvertToType(FalseVal, ResTy);
+    }
+
     builder->SetInsertPoint(MergeBB);
     // E il nome del PHI node:
-    PHINode *PN = builder->CreatePHI(Type::getDoubleTy(*context), 2, "condval_DBG"); 
+    PHINode *PN = builder->CreatePHI(ResTy, 2, "condval_DBG"); 
     PN->addIncoming(TrueVal, TrueBB);
     PN->addIncoming(FalseVal, FalseBB);
     return PN;
 };
 
+// In posizione di coda ogni ramo termina con il proprio return (e il valore è
+// convertito direttamente nel tipo del risultato): non serve il blocco di merge
+Value* IfExprAST::tailcodegen(driver& drv) {
+    Function *function = builder->GetInsertBlock()->getParent();
+    BasicBlock *TrueBB =  BasicBlock::Create(*context, "trueexp", function);
+    BasicBlock *FalseBB = BasicBlock::Create(*context, "falseexp", function);
+
+    if (!Cond->condcodegen(drv, TrueBB, FalseBB))
+        return nullptr;
+
+    builder->SetInsertPoint(TrueBB);
+    if (!TrueExp->tailcodegen(drv)) return nullptr;
+    builder->SetInsertPoint(FalseBB);
+    return FalseExp->tailcodegen(drv);
+};
+
 
 ForExprAST::ForExprAST(VarBindingAST* StartVar, ExprAST* StartExpr, ExprAST* Cond,
                        ExprAST* Step, ExprAST* Body)
     : StartVar(StartVar), StartExpr(StartExpr), Cond(Cond), Step(Step), Body(Body) {}
+
+// Estremo (escluso) intero di un ciclo contato i < E: per E double un contatore
+// intero i soddisfa i < E se e solo se i < ceil(E). Il confronto double è "unordered",
+// vero per E NaN: il ciclo non termina, come se E fosse +infinito
+static Value *countedend(Value *E) {
+  Type *IntTy = builder->getInt64Ty();
+  if (E->getType()->isIntegerTy())
+    return E;
+  if (ConstantFP *C = dyn_cast<ConstantFP>(E)) {
+    double V = C->getValueAPF().convertToDouble();
+    if (std::isnan(V) || V >= 0x1p63)
+      return ConstantInt::get(IntTy, INT64_MAX);
+    return ConstantInt::get(IntTy, V < -0x1p63 ? INT64_MIN : (int64_t) std::ceil(V), true);
+  }
+  Value *NotNaN = builder->CreateFCmpORD(E, E);
+  E = builder->CreateSelect(NotNaN, E, ConstantFP::getInfinity(E->getType()));
+  E = builder->CreateUnaryIntrinsic(Intrinsic::ceil, E);
+  return builder->CreateIntrinsic(Intrinsic::fptosi_sat, {IntTy, E->getType()}, {E}, nullptr,
+                                  "loop.end");
+}
+
+// Metadati !llvm.loop del salto all'indietro di un ciclo contato: il ciclo termina
+// sempre (mustprogress) e, con --assoc-math, va vettorizzato. Senza --assoc-math
+// decide il modello dei costi: vectorize.enable autorizzerebbe il vettorizzatore a
+// riordinare le somme double (s = s + A[i]), cambiandone il risultato
+static MDNode *looptags(driver &drv) {
+  SmallVector<Metadata*, 3> Tags = {nullptr};
+  Tags.push_back(MDNode::get(*context, MDString::get(*context, "llvm.loop.mustprogress")));
+  if (drv.assocmath)
+    Tags.push_back(MDNode::get(*context, {MDString::get(*context, "llvm.loop.vectorize.enable"),
+                                          ConstantAsMetadata::get(builder->getTrue())}));
+  MDNode *Loop = MDNode::getDistinct(*context, Tags);
+  Loop->replaceOperandWith(0, Loop);
+  return Loop;
+}
 /************************* For Expression Tree *************************/
 Value* ForExprAST::codegen(driver& drv) {
     // --- Gestione dello Scope e Inizializzazione ---
     
     AllocaInst* oldVal = nullptr;
-    std::string varName;
+    AllocaInst* Var = nullptr;   // La variabile dichiarata dal ciclo (var i = ...)
+    symbol varName;
 
     // Se il ciclo inizia con una dichiarazione "var i = ..."
     if (StartVar) {
@@ -339,33 +2213,152 @@ Value* ForExprAST::codegen(driver& drv) {
         }
         // Genera il codice per la dichiarazione, che creerà la nuova variabile 'i'
         // e la metterà in NamedValues, nascondendo quella vecchia.
-        StartVar->codegen(drv);
+        Var = StartVar->codegen(drv);
+        if (!Var)
+            return nullptr;
     } 
     // Se invece inizia con un'espressione "i = ..."
     else if (StartExpr) {
-        StartExpr->codegen(drv);
+        if (!StartExpr->codegen(drv))
+            return nullptr;
     }
 
     // --- Generazione del Ciclo (questa parte è quasi identica a prima) ---
     Function *TheFunction = builder->GetInsertBlock()->getParent();
-    BasicBlock *LoopHeader = BasicBlock::Create(*context, "loop.header", TheFunction);
     BasicBlock *LoopBody = BasicBlock::Create(*context, "loop.body", TheFunction);
     BasicBlock *AfterLoop = BasicBlock::Create(*context, "after.loop", TheFunction);
 
-    builder->CreateBr(LoopHeader);
-    builder->SetInsertPoint(LoopHeader);
+    // Un ciclo for (var i = S; i < E; ++i) il cui corpo non modifica né i né E (una
+    // costante o una variabile locale) è "contato": il contatore resta nell'intervallo
+    // [S, E) e il numero di iterazioni è noto all'ingresso. Gli estremi vengono
+    // calcolati qui, prima del salto (con --bounds-check servono a controllare gli
+    // indici una volta sola, si veda hoistcheck e il versioning più avanti)
+    driver::looprange range;
+    range.Counter = nullptr;
+    driver::looprange *shadowed = nullptr;
+    bool ranged = false, counted = false;
+    BinaryExprAST *Cmp = dynamic_cast<BinaryExprAST*>(Cond);
+    UnaryExprAST *Inc = dynamic_cast<UnaryExprAST*>(Step);
+    if (Var && Cmp && Cmp->getOp() == '<' && Inc && Inc->getOp() == 'p' &&
+        !(Body && Body->assigns(varName))) {
+        VariableExprAST *L = dynamic_cast<VariableExprAST*>(Cmp->getLHS());
+        VariableExprAST *R = dynamic_cast<VariableExprAST*>(Cmp->getRHS());
+        VariableExprAST *V = dynamic_cast<VariableExprAST*>(Inc->getOperand());
+        NumberExprAST *N = dynamic_cast<NumberExprAST*>(Cmp->getRHS());
+        NumberExprAST *S = dynamic_cast<NumberExprAST*>(StartVar->getVal());
+        AllocaInst *EndVar = R && R->getName() != varName
+                             ? drv.NamedValues.lookup(R->getName()) : nullptr;
+        if (L && L->getName() == varName && V && V->getName() == varName &&
+            (N || (EndVar && !(Body && Body->assigns(R->getName()))))) {
+            Type *T = Var->getAllocatedType();
+            range.Start = StartVar->getVal() && !S
+                ? builder->CreateLoad(T, Var, varName.name() + ".start")
+                : ConvertToType(ConstantFP::get(*context, APFloat(S ? S->getVal() : 0.0)), T);
+            range.End = N ? (Value*) ConstantFP::get(*context, APFloat(N->getVal()))
+                          : builder->CreateLoad(EndVar->getAllocatedType(), EndVar,
+                                                R->getName().name() + ".end");
+            // Un contatore double che parte da un intero assume solo valori interi:
+            // il ciclo può contare con un intero, come quello di un contatore int
+            double SV = S ? S->getVal() : 0.0;
+            counted = T->isIntegerTy() ||
+                      ((!StartVar->getVal() || S) && SV == std::trunc(SV) && std::fabs(SV) < 0x1p53);
+            if (counted) {
+                range.Start = ConvertToType(range.Start, builder->getInt64Ty());
+                range.End = countedend(range.End);
+            } else
+                unifyOperands(range.Start, range.End);
+            range.depth = drv.loopdepth;
+            shadowed = drv.ranges.lookup(varName);
+            ranged = true;
+        }
+    }
 
-    Value *CondV = Cond->codegen(drv);
-    if (!CondV) return nullptr;
+    // Un contatore double di un ciclo contato ha accanto un contatore i64, da cui
+    // i viene ricavata a ogni iterazione
+    if (counted && !Var->getAllocatedType()->isIntegerTy()) {
+        range.Counter = CreateEntryBlockAlloca(TheFunction, varName.str() + ".iv",
+                                               builder->getInt64Ty());
+        builder->CreateStore(range.Start, range.Counter);
+    }
 
-    CondV = builder->CreateFCmpONE(CondV, ConstantFP::get(*context, APFloat(0.0)), "loopcond");
+    // Genera una copia del ciclo a partire dal blocco corrente: ingresso, corpo
+    // (da LoopBody) e salto all'indietro, con uscita in AfterLoop
+    auto loopcopy = [&](BasicBlock *LoopBody) -> bool {
+        BasicBlock *LoopHeader = nullptr;
+        Value *Counter = range.Counter ? range.Counter : Var;
+        if (counted) {
+            // Il ciclo contato è generato già "ruotato", con il controllo in fondo:
+            //   if (S < E) do { corpo; ++i } while (i < E);
+            // con un contatore i64, la forma che il vettorizzatore di LLVM
+            // riconosce senza bisogno di trasformazioni preliminari
+            builder->CreateCondBr(builder->CreateICmpSLT(range.Start, range.End, "loop.guard"),
+                                  LoopBody, AfterLoop);
+            range.Preheader = builder->GetInsertBlock();
+            builder->SetInsertPoint(LoopBody);
+            if (range.Counter)
+                builder->CreateStore(builder->CreateSIToFP(
+                    builder->CreateLoad(builder->getInt64Ty(), Counter, varName.name() + ".iv"),
+                    Var->getAllocatedType()), Var);
+        } else {
+            LoopHeader = BasicBlock::Create(*context, "loop.header", TheFunction, LoopBody);
+            builder->CreateBr(LoopHeader);
+            if (ranged)
+                range.Preheader = builder->GetInsertBlock();
+            builder->SetInsertPoint(LoopHeader);
 
-    builder->CreateCondBr(CondV, LoopBody, AfterLoop);
+            if (!Cond->condcodegen(drv, LoopBody, AfterLoop)) return false;
 
-    builder->SetInsertPoint(LoopBody);
-    if (Body) Body->codegen(drv);
-    if (Step) Step->codegen(drv);
-    builder->CreateBr(LoopHeader);
+            builder->SetInsertPoint(LoopBody);
+        }
+        if (ranged)
+            drv.ranges[varName] = &range;
+        drv.loopdepth++;
+        if (Body) Body->codegen(drv);
+        drv.loopdepth--;
+        if (ranged) {
+            if (shadowed)
+                drv.ranges[varName] = shadowed;
+            else
+                drv.ranges.erase(varName);
+        }
+        if (counted) {
+            Value *Next = builder->CreateNSWAdd(
+                builder->CreateLoad(builder->getInt64Ty(), Counter, varName.name()),
+                builder->getInt64(1), "incrtmp");
+            builder->CreateStore(Next, Counter);
+            BranchInst *Latch = builder->CreateCondBr(
+                builder->CreateICmpSLT(Next, range.End, "loop.cond"), LoopBody, AfterLoop);
+            drv.profile_branch(Latch);
+            Latch->setMetadata(LLVMContext::MD_loop, looptags(drv));
+        } else {
+            if (Step) Step->codegen(drv);
+            builder->CreateBr(LoopHeader);
+        }
+        return true;
+    };
+
+    range.Ok = nullptr;
+    if (!loopcopy(LoopBody))
+        return nullptr;
+    // Versioning: se qualche controllo degli indici è stato portato prima del ciclo
+    // (si veda hoistcheck) ma non è risultato sempre vero, la condizione Ok sceglie
+    // fra il ciclo appena generato, senza quei controlli, e una seconda copia con i
+    // controlli nel corpo. Se un indice esce dai limiti, le iterazioni precedenti
+    // vengono eseguite e l'errore riporta il primo indice sbagliato, come senza hoisting
+    if (range.Ok) {
+        BasicBlock *Checked = BasicBlock::Create(*context, "loop.checked", TheFunction, AfterLoop);
+        BasicBlock *Cont = SplitBlock(range.Preheader, range.Preheader->getTerminator());
+        range.Preheader->getTerminator()->eraseFromParent();
+        IRBuilder<> B(range.Preheader);
+        B.CreateCondBr(range.Ok, Cont, Checked, MDBuilder(*context).createBranchWeights(1 << 20, 1));
+        builder->SetInsertPoint(Checked);
+        drv.inlinechecks++;
+        bool ok = loopcopy(BasicBlock::Create(*context, "loop.body.checked", TheFunction, AfterLoop));
+        drv.inlinechecks--;
+        if (!ok)
+            return nullptr;
+        drv.loopsversioned++;
+    }
 
     builder->SetInsertPoint(AfterLoop);
 
@@ -390,6 +2383,7 @@ Value* ForExprAST::codegen(driver& drv) {
 
 Value* BlockExprAST::codegen(driver& drv) {
   Value* last = nullptr;
+  size_t scope = drv.arrayscopes.size();
 
   // 1) genera il side-effect di ciascuno stmt
   for (auto *S : Stmts) {
@@ -398,25 +2392,48 @@ Value* BlockExprAST::codegen(driver& drv) {
   }
 
   // 2) genera e ritorna il valore dell'ultima espressione
+  // (altrimenti ritorna 0.0 di default)
+  Value *V = RetExpr ? RetExpr->codegen(drv) : ConstantFP::get(*context, APFloat(0.0));
+  // 3) rilascia gli array locali dichiarati nel blocco
+  if (V)
+    releasearrays(drv, scope);
+  return V;
+}
+
+// Solo l'ultima espressione del blocco è in posizione di coda. Se il blocco
+// dichiara array locali la loro memoria va rilasciata dopo il calcolo del valore,
+// che quindi non è più in posizione di coda
+Value* BlockExprAST::tailcodegen(driver& drv) {
+  Function *function = builder->GetInsertBlock()->getParent();
+  for (auto *S : Stmts)
+    if (dynamic_cast<ArrayBindingAST*>(S)) {
+      Value *V = codegen(drv);
+      if (!V)
+        return nullptr;
+      return builder->CreateRet(ConvertToType(V, function->getReturnType()));
+    }
+  for (auto *S : Stmts)
+    if (!S->codegen(drv)) return nullptr;
   if (RetExpr)
-    return RetExpr->codegen(drv);
-  // altrimenti ritorna 0.0 di default
-  return ConstantFP::get(*context, APFloat(0.0));
+    return RetExpr->tailcodegen(drv);
+  return builder->CreateRet(ConvertToType(ConstantFP::get(*context, APFloat(0.0)),
+                                          function->getReturnType()));
 }
 
 
 /************************* Var binding Tree *************************/
-VarBindingAST::VarBindingAST(const std::string Name, ExprAST* Val):
-   Name(Name), Val(Val) {};
+VarBindingAST::VarBindingAST(symbol Name, ExprAST* Val, KType T):
+   Name(Name), Val(Val), T(T) {};
    
-const std::string& VarBindingAST::getName() const { 
+symbol VarBindingAST::getName() const { 
    return Name; 
 };
 
 AllocaInst* VarBindingAST::codegen(driver& drv) {
    Function *fun = builder->GetInsertBlock()->getParent();
    // Allocate memory for the variable in the entry block
-   AllocaInst *Alloca = CreateEntryBlockAlloca(fun, Name);
+   Type *VarTy = LLVMType(T);
+   AllocaInst *Alloca = CreateEntryBlockAlloca(fun, Name.name(), VarTy);
 
    Value *InitialVal;
    if (Val) { // If an explicit initializer expression (Val) is provided
@@ -428,8 +2445,9 @@ AllocaInst* VarBindingAST::codegen(driver& drv) {
          // For robustness, you might return nullptr or ensure a default even here.
          return nullptr; // Or LogErrorV and return nullptr
       }
-   } else { // No explicit initializer, default to 0.0
-      InitialVal = ConstantFP::get(*context, APFloat(0.0));
+      InitialVal = ConvertToType(InitialVal, VarTy);
+   } else { // No explicit initializer, default to 0 (0.0 for doubles)
+      InitialVal = Constant::getNullValue(VarTy);
    }
 
    // Store the initial value (either from expression or default 0.0)
@@ -442,15 +2460,17 @@ AllocaInst* VarBindingAST::codegen(driver& drv) {
 }
 
 /************************* Prototype Tree *************************/
-PrototypeAST::PrototypeAST(std::string Name, std::vector<std::string> Args):
-  Name(Name), Args(std::move(Args)), emitcode(true) {};  //Di regola il codice viene emesso
+PrototypeAST::PrototypeAST(symbol Name, std::vector<KParam> Args,
+                           KType RetType):
+  Name(Name), Args(std::move(Args)), RetType(RetType),
+  emitcode(true) {};  //Di regola il codice viene emesso
 
 lexval PrototypeAST::getLexVal() const {
-   lexval lval = Name;
+   lexval lval = Name.str();
    return lval;	
 };
 
-const std::vector<std::string>& PrototypeAST::getArgs() const { 
+const std::vector<KParam>& PrototypeAST::getArgs() const { 
    return Args;
 };
 
@@ -459,27 +2479,50 @@ void PrototypeAST::noemit() {
    emitcode = false; 
 };
 
-Function *PrototypeAST::codegen(driver& drv) {
-  // Costruisce una struttura, qui chiamata FT, che rappresenta il "tipo" di una
-  // funzione. Con ciò si intende a sua volta una coppia composta dal tipo
-  // del risultato (valore di ritorno) e da un vettore che contiene il tipo di tutti
-  // i parametri. Si ricordi, tuttavia, che nel nostro caso l'unico tipo è double.
-  
-  // Prima definiamo il vettore (qui chiamato Doubles) con il tipo degli argomenti
-  std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(*context));
+// Costruisce una struttura, qui chiamata FT, che rappresenta il "tipo" di una
+// funzione. Con ciò si intende a sua volta una coppia composta dal tipo
+// del risultato (valore di ritorno) e da un vettore che contiene il tipo di tutti
+// i parametri. I tipi possibili sono double (predefinito) e int.
+// Un parametro array A[] diventa una coppia di parametri: il puntatore al primo
+// elemento e il numero di elementi (i64), come double *A, int64_t n in C
+FunctionType *PrototypeAST::functype() const {
+  // Prima definiamo il vettore (qui chiamato ArgTypes) con il tipo degli argomenti
+  std::vector<Type*> ArgTypes;
+  for (auto &Arg : Args)
+    if (Arg.Array) {
+      ArgTypes.push_back(LLVMType(Arg.T)->getPointerTo());
+      ArgTypes.push_back(Type::getInt64Ty(*context));
+    } else
+      ArgTypes.push_back(LLVMType(Arg.T));
   // Quindi definiamo il tipo (FT) della funzione
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(*context), Doubles, false);
-  // Infine definiamo una funzione (al momento senza body) del tipo creato e con il nome
+  return FunctionType::get(LLVMType(RetType), ArgTypes, false);
+}
+
+Function *PrototypeAST::codegen(driver& drv) {
+  FunctionType *FT = functype();
+  // Definiamo una funzione (al momento senza body) del tipo creato e con il nome
   // presente nel nodo AST. ExternalLinkage vuol dire che la funzione può avere
-  // visibilità anche al di fuori del modulo
-  Function *F = Function::Create(FT, Function::ExternalLinkage, Name, *module);
+  // visibilità anche al di fuori del modulo. Una dichiarazione precedente con lo
+  // stesso prototipo (extern f seguito da def f, oppure le dichiarazioni che il
+  // REPL ripropone prima di ogni elemento) viene riusata
+  Function *F = module->getFunction(Name.name());
+  if (!F || !F->isDeclaration() || F->getFunctionType() != FT)
+    F = Function::Create(FT, Function::ExternalLinkage, Name.name(), *module);
+  // Una funzione definita in un elemento precedente del REPL non è l'omonima
+  // funzione della libreria C: una chiamata a sqrt non diventa l'istruzione sqrtsd
+  if (drv.externals.count(Name.str()))
+    F->addFnAttr(Attribute::NoBuiltin);
 
   // Ad ogni parametro della funzione F (che, è bene ricordare, è la rappresentazione 
   // llvm di una funzione, non è una funzione C++) attribuiamo ora il nome specificato dal
   // programmatore e presente nel nodo AST relativo al prototipo
   unsigned Idx = 0;
-  for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+  for (auto &Arg : Args) {
+    F->getArg(Idx++)->setName(Arg.Name.name());
+    if (Arg.Array)
+      F->getArg(Idx++)->setName(Arg.Name.name() + ".size");
+  }
+  drv.prototypes[Name] = this;
 
   /* Abbiamo completato la creazione del codice del prototipo.
      Il codice può quindi essere emesso, ma solo se esso corrisponde
@@ -503,19 +2546,25 @@ Function *PrototypeAST::codegen(driver& drv) {
 FunctionAST::FunctionAST(PrototypeAST* Proto, ExprAST* Body): Proto(Proto), Body(Body) {};
 
 Function *FunctionAST::codegen(driver& drv) {
+  double start = drv.timing ? wallms() : 0;
   // Verifica che la funzione non sia già presente nel modulo, cioò che non
-  // si tenti una "doppia definizion"
-  Function *function = 
-      module->getFunction(std::get<std::string>(Proto->getLexVal()));
-  // Se la funzione non è già presente, si prova a definirla, innanzitutto
-  // generando (ma non emettendo) il codice del prototipo
-  if (!function)
-    function = Proto->codegen(drv);
-  else
-    return nullptr;
+  // si tenti una "doppia definizion"; può invece essere già dichiarata (extern)
+  Function *function = module->getFunction(Proto->getName().name());
+  if (function && !function->isDeclaration())
+    return (Function*) LogErrorV("Funzione " + Proto->getName().str() + " già definita");
+  // Si prova dunque a definirla, innanzitutto generando (ma non emettendo) il codice
+  // del prototipo
+  function = Proto->codegen(drv);
   // Se, per qualche ragione, la definizione "fallisce" si restituisce nullptr
   if (!function)
     return nullptr;  
+  // Una dichiarazione con un prototipo diverso lascia alla nuova funzione un nome
+  // diverso (f.1)
+  if (function->getName() != Proto->getName().name()) {
+    function->eraseFromParent();
+    LogErrorV("Prototipo di " + Proto->getName().str() + " diverso da quello già dichiarato");
+    return nullptr;
+  }
 
   // Altrimenti si crea un blocco di base in cui iniziare a inserire il codice
   BasicBlock *BB = BasicBlock::Create(*context, "entry", function);
@@ -534,26 +2583,45 @@ Function *FunctionAST::codegen(driver& drv) {
   // perché esso è parte della rappresentazione C++ dell'istruzione di allocazione
   // (variabile Alloca) 
   
-  for (auto &Arg : function->args()) {
+  // I parametri array non hanno bisogno di memoria propria: puntatore e dimensione
+  // vengono usati direttamente e l'array è registrato fra gli array visibili.
+  // Le variabili locali della funzione precedente non sono più visibili
+  drv.NamedValues.clear();
+  drv.arrays.clear();
+  drv.arrayscopes.clear();
+  unsigned Idx = 0;
+  for (auto &P : Proto->getArgs()) {
+    Argument &Arg = *function->getArg(Idx++);
+    if (P.Array) {
+      drv.arrays[P.Name] = driver::arrayref{&Arg, function->getArg(Idx++), LLVMType(P.T), 0};
+      continue;
+    }
     // Genera l'istruzione di allocazione per il parametro corrente
-    AllocaInst *Alloca = CreateEntryBlockAlloca(function, Arg.getName());
+    AllocaInst *Alloca = CreateEntryBlockAlloca(function, Arg.getName(), Arg.getType());
     // Genera un'istruzione per la memorizzazione del parametro nell'area
     // di memoria allocata
     builder->CreateStore(&Arg, Alloca);
     // Registra gli argomenti nella symbol table per eventuale riferimento futuro
-    drv.NamedValues[std::string(Arg.getName())] = Alloca;
+    drv.NamedValues[P.Name] = Alloca;
   } 
+  drv.profile_begin(function);
   
   // Ora può essere generato il codice corssipondente al body (che potrà
   // fare riferimento alla symbol table)
-  if (Value *RetVal = Body->codegen(drv)) {
-    // Se la generazione termina senza errori, ciò che rimane da fare è
-    // di generare l'istruzione return, che ("a tempo di esecuzione") prenderà
-    // il valore lasciato nel registro RetVal 
-    builder->CreateRet(RetVal);
+  // Il corpo è in posizione di coda: le istruzioni ret (che restituiscono il valore
+  // calcolato, convertito nel tipo del risultato) sono generate da tailcodegen
+  if (Body->tailcodegen(drv)) {
+    drv.profile_end(function);
+    if (drv.timing)
+      drv.functime.emplace_back(std::string(function->getName()), wallms() - start);
 
     // Effettua la validazione del codice e un controllo di consistenza
-    verifyFunction(*function);
+    {
+      phasetimer t(drv, "codegen.verify");
+      verifyFunction(*function);
+    }
+    // Ottimizzazioni locali alla funzione (solo se richieste con -O1 ... -O3)
+    drv.optimize_function(*function);
  
     // Emissione del codice su su stderr) 
     //function->print(errs());
@@ -563,12 +2631,20 @@ Function *FunctionAST::codegen(driver& drv) {
 
   // Errore nella definizione. La funzione viene rimossa
   function->eraseFromParent();
+  drv.profile_end(nullptr);
   return nullptr;
 };
 
 UnaryExprAST::UnaryExprAST(char Op, ExprAST* Operand)
     : Op(Op), Operand(Operand) {}
 
+// not come condizione: basta scambiare le destinazioni del salto
+Value* UnaryExprAST::condcodegen(driver& drv, BasicBlock *TrueBB, BasicBlock *FalseBB) {
+    if (Op == '!')
+        return Operand->condcodegen(drv, FalseBB, TrueBB);
+    return ExprAST::condcodegen(drv, TrueBB, FalseBB);
+}
+
 Value* UnaryExprAST::codegen(driver& drv) {
     VariableExprAST* varAST = dynamic_cast<VariableExprAST*>(Operand);
 
@@ -576,34 +2652,42 @@ Value* UnaryExprAST::codegen(driver& drv) {
         case 'p': {
             if (!varAST)
                 return LogErrorV("L'operando dell'operatore unario ++ deve essere una variabile");
-            std::string varName = std::get<std::string>(varAST->getLexVal());
+            symbol varName = varAST->getName();
             Value* varPtr = drv.NamedValues[varName];
             if (!varPtr) {
-                varPtr = module->getGlobalVariable(varName);
+                varPtr = module->getGlobalVariable(varName.name());
             }
             if (!varPtr) {
-                return LogErrorV("Variabile non definita per '++': " + varName);
+                return LogErrorV("Variabile non definita per '++': " + varName.str());
             }
-            Value* oldVal = builder->CreateLoad(Type::getDoubleTy(*context), varPtr, varName.c_str());
+            Type* varTy = isa<AllocaInst>(varPtr) ? cast<AllocaInst>(varPtr)->getAllocatedType()
+                                                  : cast<GlobalVariable>(varPtr)->getValueType();
+            Value* oldVal = builder->CreateLoad(varTy, varPtr, varName.name());
             if (!oldVal) return nullptr;
-            Value* newVal = builder->CreateFAdd(oldVal, ConstantFP::get(*context, APFloat(1.0)), "incrtmp");
+            Value* newVal = varTy->isIntegerTy()
+                ? builder->CreateNSWAdd(oldVal, ConstantInt::get(varTy, 1), "incrtmp")
+                : builder->CreateFAdd(oldVal, ConstantFP::get(*context, APFloat(1.0)), "incrtmp");
             builder->CreateStore(newVal, varPtr);
             return newVal;
         }
         case 'm': {
             if (!varAST)
                 return LogErrorV("L'operando dell'operatore unario -- deve essere una variabile");
-            std::string varName = std::get<std::string>(varAST->getLexVal());
+            symbol varName = varAST->getName();
             Value* varPtr = drv.NamedValues[varName];
             if (!varPtr) {
-                varPtr = module->getGlobalVariable(varName);
+                varPtr = module->getGlobalVariable(varName.name());
             }
             if (!varPtr) {
-                return LogErrorV("Variabile non definita per '--': " + varName);
+                return LogErrorV("Variabile non definita per '--': " + varName.str());
             }
-            Value* oldVal = builder->CreateLoad(Type::getDoubleTy(*context), varPtr, varName.c_str());
+            Type* varTy = isa<AllocaInst>(varPtr) ? cast<AllocaInst>(varPtr)->getAllocatedType()
+                                                  : cast<GlobalVariable>(varPtr)->getValueType();
+            Value* oldVal = builder->CreateLoad(varTy, varPtr, varName.name());
             if (!oldVal) return nullptr;
-            Value* newVal = builder->CreateFSub(oldVal, ConstantFP::get(*context, APFloat(1.0)), "decrtmp");
+            Value* newVal = varTy->isIntegerTy()
+                ? builder->CreateNSWSub(oldVal, ConstantInt::get(varTy, 1), "decrtmp")
+                : builder->CreateFSub(oldVal, ConstantFP::get(*context, APFloat(1.0)), "decrtmp");
             builder->CreateStore(newVal, varPtr);
             return newVal;
         }
@@ -611,15 +2695,12 @@ Value* UnaryExprAST::codegen(driver& drv) {
             Value* operandV = Operand->codegen(drv);
             if (!operandV)
                 return nullptr;
+            if (operandV->getType()->isIntegerTy())
+                return builder->CreateNSWNeg(operandV, "negtmp");
             return builder->CreateFNeg(operandV, "negtmp");
         }
-        case '!': {
-            Value* operandV = Operand->codegen(drv);
-            if (!operandV) return nullptr;
-            Value* operand_i1 = builder->CreateFCmpONE(operandV, ConstantFP::get(*context, APFloat(0.0)), "tobool_not_arg");
-            Value* not_i1 = builder->CreateICmpEQ(operand_i1, ConstantInt::get(Type::getInt1Ty(*context), 0), "not_res_i1");
-            return builder->CreateUIToFP(not_i1, Type::getDoubleTy(*context), "bool_to_double_not");
-        }
+        case '!':
+            return boolvalue(drv, this, "not");
         default:
             return LogErrorV("Operatore unario sconosciuto: " + std::string(1, Op));
     }
@@ -630,11 +2711,6 @@ IfStmtAST::IfStmtAST(ExprAST* Cond, ExprAST* ThenBranch, ExprAST* ElseBranch)
 
 // Implementazione del codegen CORRETTA
 Value* IfStmtAST::codegen(driver& drv) {
-    Value* CondV = Cond->codegen(drv);
-    if (!CondV)
-        return nullptr;
-    CondV = builder->CreateFCmpONE(CondV, ConstantFP::get(*context, APFloat(0.0)), "ifcond");
-
     Function *TheFunction = builder->GetInsertBlock()->getParent();
 
     // Crea i blocchi per i rami 'then' ed 'else', associandoli a TheFunction.
@@ -645,12 +2721,12 @@ Value* IfStmtAST::codegen(driver& drv) {
     // Usa i nomi corretti dei membri: ElseBranch invece di Else
     if (ElseBranch) {
         // Se c'è un blocco 'else', salta a ThenBB o a ElseBB
-        builder->CreateCondBr(CondV, ThenBB, ElseBB);
+        if (!Cond->condcodegen(drv, ThenBB, ElseBB)) return nullptr;
     } else {
         // Altrimenti, salta a ThenBB o direttamente dopo l'if (MergeBB)
         // e rimuovi il blocco ElseBB se non viene usato.
         ElseBB->eraseFromParent(); // Rimuoviamo ElseBB se non c'è un ramo else
-        builder->CreateCondBr(CondV, ThenBB, MergeBB);
+        if (!Cond->condcodegen(drv, ThenBB, MergeBB)) return nullptr;
     }
 
     // Genera il codice per il blocco 'then'
@@ -693,16 +2769,24 @@ Value* GlobalDeclAST::codegen(driver& drv) {
     // In LLVM, una variabile globale può essere dichiarata più volte se ha linkage 'common'
     // o se le dichiarazioni successive sono solo 'declarations' e non 'definitions'.
     // Per semplicità, se esiste già, restituiamo il puntatore esistente.
-    if (GlobalVariable *ExistingGV = module->getGlobalVariable(Name)) {
+    if (GlobalVariable *ExistingGV = module->getGlobalVariable(Name.name())) {
         // Potresti voler verificare che il tipo e la dimensione corrispondano se è già definita,
         // ma per ora questo è sufficiente per evitare errori di linkage.
         return ExistingGV; 
     }
 
+    // Una variabile definita in un modulo precedente (un elemento già eseguito dal
+    // REPL) viene soltanto dichiarata: il JIT la risolve con quella esistente
+    if (drv.externals.count(Name.str()))
+        return new GlobalVariable(*module,
+                                  isArray() ? (Type*) ArrayType::get(LLVMType(T), ArraySize)
+                                            : LLVMType(T),
+                                  false, GlobalValue::ExternalLinkage, nullptr, Name.name());
+
     if (isArray()) { // È un array
         // 1. Definisci il tipo dell'array: ArrayType::get(elementType, numElements)
-        //    elementType è double, numElements è ArraySize.
-        ArrayType* arrayTy = ArrayType::get(Type::getDoubleTy(*context), ArraySize);
+        //    elementType è double o int (i64), numElements è ArraySize.
+        ArrayType* arrayTy = ArrayType::get(LLVMType(T), ArraySize);
         
         // 2. Crea l'inizializzatore. Per un array globale, di solito lo si inizializza a zero.
         //    ConstantAggregateZero::get(ArrayType*) crea un inizializzatore zero per l'array.
@@ -717,106 +2801,241 @@ Value* GlobalDeclAST::codegen(driver& drv) {
             false,                            // isConstant (false = non è costante, può essere modificata)
             GlobalValue::CommonLinkage,       // Tipo di Linkage
             Initializer,                      // Inizializzatore (array di zeri)
-            Name                              // Nome della variabile globale
+            Name.name()                       // Nome della variabile globale
         );
         // GV->setAlignment(Align(8)); // LLVM di solito gestisce l'allineamento, 
                                      // ma potresti specificarlo se necessario (es. 8 per double)
         return GV;
     } else { // È una variabile scalare (simile al tuo codice esistente)
-        // 1. Definisci l'inizializzatore (0.0 per un double scalare)
-        Constant* Initializer = ConstantFP::get(*context, APFloat(0.0));
+        // 1. Definisci l'inizializzatore (0.0 per un double scalare, 0 per un int)
+        Constant* Initializer = Constant::getNullValue(LLVMType(T));
 
         // 2. Crea la GlobalVariable per lo scalare.
         GlobalVariable *GV = new GlobalVariable(
             *module,
-            Type::getDoubleTy(*context),      // Tipo (double)
+            LLVMType(T),                      // Tipo (double o int)
             false,                            // isConstant
             GlobalValue::CommonLinkage,       // Tipo di Linkage
             Initializer,                      // Inizializzatore (0.0)
-            Name                              // Nome
+            Name.name()                       // Nome
         );
         // GV->setAlignment(Align(8));
         return GV;
     }
     return nullptr; // Non dovrebbe mai essere raggiunto
 }
-Value* ArrayAccessExprAST::codegen(driver& drv) {
-    // 1. Trova il puntatore all'array globale.
-    GlobalVariable* arrayVar = module->getGlobalVariable(ArrayName);
-    if (!arrayVar) {
-        return LogErrorV("Array globale non definito: " + ArrayName);
+
+/******************** Controllo dei limiti *************************/
+// Con --bounds-check ogni accesso A[x] verifica che l'indice sia compreso fra 0 e
+// la dimensione N dell'array: per un indice int basta un confronto senza segno,
+// un indice double (troncato da fptosi) deve soddisfare -1 < x < N. Altrimenti il
+// programma termina con un messaggio su stderr
+
+// Funzione, interna al modulo, che segnala l'errore e termina il programma
+static Function *boundsfail() {
+  if (Function *F = module->getFunction("__kcomp.boundsfail"))
+    return F;
+  IRBuilder<> B(*context);
+  Function *F = Function::Create(
+      FunctionType::get(B.getVoidTy(), {B.getInt8PtrTy(), B.getInt64Ty(), B.getInt64Ty()}, false),
+      Function::InternalLinkage, "__kcomp.boundsfail", module);
+  F->addFnAttr(Attribute::NoReturn);
+  F->addFnAttr(Attribute::Cold);
+  F->addFnAttr(Attribute::NoInline);
+  FunctionCallee Print = module->getOrInsertFunction("dprintf",
+      FunctionType::get(B.getInt32Ty(), {B.getInt32Ty(), B.getInt8PtrTy()}, true));
+  FunctionCallee Abort = module->getOrInsertFunction("abort",
+      FunctionType::get(B.getVoidTy(), false));
+  B.SetInsertPoint(BasicBlock::Create(*context, "entry", F));
+  B.CreateCall(Print, {B.getInt32(2),
+                       B.CreateGlobalStringPtr("indice %ld fuori dai limiti di %s[%ld]\n"),
+                       F->getArg(1), F->getArg(0), F->getArg(2)});
+  B.CreateCall(Abort);
+  B.CreateUnreachable();
+  return F;
+}
+
+// Chiude il blocco corrente di B con il salto a Cont se Ok è vero, altrimenti a un
+// nuovo blocco che segnala l'errore. Il blocco viene restituito perché vi si
+// possa calcolare l'indice da riportare
+static BasicBlock *CreateBoundsBranch(IRBuilder<> &B, Value *Ok, BasicBlock *Cont) {
+  Function *F = B.GetInsertBlock()->getParent();
+  BasicBlock *Fail = BasicBlock::Create(*context, "bounds.fail", F);
+  B.CreateCondBr(Ok, Cont, Fail, MDBuilder(*context).createBranchWeights(1 << 20, 1));
+  return Fail;
+}
+
+static void CreateBoundsFail(BasicBlock *Fail, symbol Name,
+                             const driver::arrayref &A, Value *Idx) {
+  IRBuilder<> B(Fail);
+  if (!Idx->getType()->isIntegerTy())
+    Idx = B.CreateIntrinsic(Intrinsic::fptosi_sat, {B.getInt64Ty(), Idx->getType()}, {Idx});
+  B.CreateCall(boundsfail(), {B.CreateGlobalStringPtr(Name.name()), Idx, A.Size});
+  B.CreateUnreachable();
+}
+
+// Riconosce gli indici della forma i, i+c, i-c e c+i, con c costante intera
+static bool loopindex(ExprAST *E, symbol &Var, int64_t &C) {
+  double V;
+  if (VariableExprAST *X = dynamic_cast<VariableExprAST*>(E)) {
+    Var = X->getName();
+    C = 0;
+    return true;
+  }
+  BinaryExprAST *B = dynamic_cast<BinaryExprAST*>(E);
+  if (!B || (B->getOp() != '+' && B->getOp() != '-'))
+    return false;
+  ExprAST *X = B->getLHS(), *K = B->getRHS();
+  if (B->getOp() == '+' && isConst(X, V))
+    std::swap(X, K);
+  if (!dynamic_cast<VariableExprAST*>(X) || !isConst(K, V) ||
+      V != std::trunc(V) || std::fabs(V) >= 1e9)
+    return false;
+  Var = static_cast<VariableExprAST*>(X)->getName();
+  C = B->getOp() == '+' ? V : -V;
+  return true;
+}
+
+// Controllo di A[i+c] con i contatore di un ciclo di intervallo [S, E): tutti gli
+// indici sono nei limiti se il ciclo non viene eseguito (S >= E) oppure se
+// S+c >= 0 ed E+c <= N. La condizione si calcola una volta sola prima del ciclo,
+// se N è già noto (è costante, è un parametro o l'array è dichiarato fuori dal
+// ciclo). Se è costante e vera il controllo sparisce; altrimenti si aggiunge alla
+// condizione Ok del ciclo, che sceglie fra la copia senza controlli e quella con
+// i controlli nel corpo (si veda il versioning in ForExprAST::codegen). Vale anche
+// per un accesso non eseguito a ogni iterazione (in un if o in un ciclo interno):
+// la condizione basta a garantire che nessun accesso del ciclo esca dai limiti.
+// Restituisce true se l'accesso non richiede altri controlli
+static bool hoistcheck(driver &drv, const driver::arrayref &A, ExprAST *IndexExpr) {
+  symbol Var;
+  int64_t C;
+  if (drv.inlinechecks || !loopindex(IndexExpr, Var, C) || !drv.ranges.count(Var))
+    return false;
+  driver::looprange &R = *drv.ranges[Var];
+  if (R.checked.count({A.Ptr, C}))
+    return true;
+  if (!isa<Constant>(A.Size) && !isa<Argument>(A.Size) && A.depth > R.depth)
+    return false;
+  IRBuilder<> B(R.Preheader->getTerminator());
+  Type *T = R.Start->getType();
+  Value *Ok, *Skip;
+  if (T->isIntegerTy()) {
+    Ok = B.CreateAnd(B.CreateICmpSGE(R.Start, ConstantInt::get(T, -C)),
+                     B.CreateICmpSLE(R.End, B.CreateSub(A.Size, ConstantInt::get(T, C))));
+    Skip = B.CreateICmpSGE(R.Start, R.End);
+  } else {
+    Ok = B.CreateAnd(B.CreateFCmpOGT(R.Start, ConstantFP::get(T, -1.0 - C)),
+                     B.CreateFCmpOLE(R.End, B.CreateFSub(B.CreateSIToFP(A.Size, T),
+                                                         ConstantFP::get(T, (double) C))));
+    Skip = B.CreateFCmpOGE(R.Start, R.End);
+  }
+  Ok = B.CreateOr(Skip, Ok, "bounds.inrange");
+  if (ConstantInt *K = dyn_cast<ConstantInt>(Ok)) {
+    // Sempre nei limiti: nessun controllo. Sempre fuori: i controlli restano nel corpo
+    if (K->isZero())
+      return false;
+    R.checked.insert({A.Ptr, C});
+    drv.checksremoved++;
+    return true;
+  }
+  R.Ok = R.Ok ? B.CreateAnd(R.Ok, Ok, "bounds.hoisted") : Ok;
+  R.checked.insert({A.Ptr, C});
+  drv.checkshoisted++;
+  return true;
+}
+
+// Indice i64 dell'elemento dell'array Name selezionato da IndexExpr: un indice int
+// viene usato così com'è, un indice double va invece convertito con fptosi
+// (floating point to signed integer), che tronca la parte frazionaria
+static Value *arrayindex(driver &drv, symbol Name, const driver::arrayref &A,
+                         ExprAST *IndexExpr, const Twine &IdxName) {
+  // L'indice i, i+c o i-c con i contatore double di un ciclo contato si ricava
+  // direttamente dal contatore intero, senza passare per il double
+  symbol Var;
+  int64_t C;
+  Value *Idx;
+  if (loopindex(IndexExpr, Var, C) && drv.ranges.count(Var) && drv.ranges[Var]->Counter)
+    Idx = builder->CreateNSWAdd(builder->CreateLoad(builder->getInt64Ty(),
+                                                    drv.ranges[Var]->Counter, Var.name() + ".iv"),
+                                builder->getInt64(C), IdxName);
+  else
+    Idx = IndexExpr->codegen(drv);
+  if (!Idx)
+    return nullptr;
+  if (drv.boundscheck && !hoistcheck(drv, A, IndexExpr)) {
+    Value *Ok = Idx->getType()->isIntegerTy()
+        ? builder->CreateICmpULT(Idx, A.Size, "inbounds")
+        : builder->CreateAnd(
+              builder->CreateFCmpOGT(Idx, ConstantFP::get(Idx->getType(), -1.0)),
+              builder->CreateFCmpOLT(Idx, builder->CreateSIToFP(A.Size, Idx->getType())),
+              "inbounds");
+    ConstantInt *K = dyn_cast<ConstantInt>(Ok);
+    if (K && K->isOne())           // Indice costante nei limiti
+      drv.checksremoved++;
+    else {
+      Function *F = builder->GetInsertBlock()->getParent();
+      BasicBlock *Cont = BasicBlock::Create(*context, "bounds.ok", F,
+                                            builder->GetInsertBlock()->getNextNode());
+      CreateBoundsFail(CreateBoundsBranch(*builder, Ok, Cont), Name, A, Idx);
+      builder->SetInsertPoint(Cont);
+      drv.checksinline++;
     }
+  }
+  return Idx->getType()->isIntegerTy()
+      ? Idx
+      : builder->CreateFPToSI(Idx, Type::getInt64Ty(*context), IdxName);
+}
 
-    // Verifica che sia effettivamente un puntatore a un tipo array.
-    // Il tipo di una GlobalVariable è un PointerType al tipo della variabile.
-    // Quindi arrayVar->getValueType() ci dà il tipo dell'array (es. [10 x double]).
-    if (!arrayVar->getValueType()->isArrayTy()) {
-        return LogErrorV(ArrayName + " non è un array globale.");
+Value* ArrayAccessExprAST::codegen(driver& drv) {
+    // 1. Trova l'array: locale, parametro array o globale (si veda lookuparray).
+    driver::arrayref array;
+    if (!lookuparray(drv, ArrayName, array)) {
+        return LogErrorV("Array non definito: " + ArrayName.str());
     }
-    // ArrayType* arrayTy = cast<ArrayType>(arrayVar->getValueType()); // Utile se serve la dimensione
 
     // 2. Valuta l'espressione dell'indice.
-    Value* indexVal = IndexExpr->codegen(drv);
-    if (!indexVal) {
+    // L'indice dovrebbe essere un intero. LLVM GEP si aspetta i64 per gli indici
+    // (si veda arrayindex, che all'occorrenza ne controlla anche i limiti).
+    Value* indexInt = arrayindex(drv, ArrayName, array, IndexExpr, "indexcast");
+    if (!indexInt) {
         return nullptr;
     }
 
-    // L'indice dovrebbe essere un intero. LLVM GEP si aspetta i64 per gli indici.
-    // Il nostro linguaggio usa double per tutto, quindi dobbiamo convertire l'indice
-    // da double a i64. Attenzione: questo tronca la parte frazionaria.
-    // Sarebbe meglio avere un tipo intero nel linguaggio per gli indici.
-    // Per ora, facciamo fptosi (floating point to signed integer).
-    Value* indexInt = builder->CreateFPToSI(indexVal, Type::getInt64Ty(*context), "indexcast");
-
-    // 3. Prepara gli indici per l'istruzione GEP (GetElementPtr).
+    // 3. Genera l'istruzione GEP (GetElementPtr) per ottenere il puntatore all'elemento.
     // Per un array globale come @A = global [10 x double], ...
     // un GEP per accedere a A[i] necessita di due indici:
     //   - Il primo indice (0) dereferenzia il puntatore globale per ottenere l'array stesso.
     //   - Il secondo indice (indexInt) seleziona l'elemento nell'array.
-    std::vector<Value*> indices;
-    indices.push_back(ConstantInt::get(Type::getInt64Ty(*context), 0)); // Indice per il puntatore globale
-    indices.push_back(indexInt);                                       // Indice per l'elemento dell'array
+    // Per un array locale o un parametro si parte invece dal puntatore al primo elemento.
+    Value* elemPtr = arrayelement(array, indexInt, "arrayidx");
 
-    // 4. Genera l'istruzione GEP per ottenere il puntatore all'elemento.
-    //    arrayVar è già un pointer type, quindi il primo argomento di CreateGEP è il tipo PUNTATO da arrayVar,
-    //    cioè il tipo dell'array stesso (es. [10 x double]).
-    Value* elemPtr = builder->CreateGEP(arrayVar->getValueType(), arrayVar, indices, "arrayidx");
-
-    // 5. Carica il valore dall'indirizzo dell'elemento.
-    //    Il tipo da caricare è il tipo dell'elemento dell'array, che è double.
-    return builder->CreateLoad(Type::getDoubleTy(*context), elemPtr, "loadtmp");
+    // 4. Carica il valore dall'indirizzo dell'elemento.
+    //    Il tipo da caricare è il tipo dell'elemento dell'array (double o int).
+    return builder->CreateLoad(array.ElemTy, elemPtr, "loadtmp");
 }
 
 Value* ArrayAssignExprAST::codegen(driver& drv) {
-    // 1. Trova il puntatore all'array globale.
-    GlobalVariable* arrayVar = module->getGlobalVariable(ArrayName);
-    if (!arrayVar) {
-        return LogErrorV("Array globale non definito per l'assegnazione: " + ArrayName);
-    }
-    if (!arrayVar->getValueType()->isArrayTy()) {
-        return LogErrorV(ArrayName + " non è un array globale per l'assegnazione.");
+    // 1. Trova l'array.
+    driver::arrayref array;
+    if (!lookuparray(drv, ArrayName, array)) {
+        return LogErrorV("Array non definito per l'assegnazione: " + ArrayName.str());
     }
 
     // 2. Valuta l'espressione dell'indice e convertila in intero.
-    Value* indexVal = IndexExpr->codegen(drv);
-    if (!indexVal) return nullptr;
-    Value* indexInt = builder->CreateFPToSI(indexVal, Type::getInt64Ty(*context), "indexcast_assign");
+    Value* indexInt = arrayindex(drv, ArrayName, array, IndexExpr, "indexcast_assign");
+    if (!indexInt) return nullptr;
 
     // 3. Valuta l'espressione del valore da assegnare (RHS).
     Value* valueToStore = ValueExpr->codegen(drv);
     if (!valueToStore) return nullptr;
+    valueToStore = ConvertToType(valueToStore, array.ElemTy);
 
-    // 4. Prepara gli indici per GEP.
-    std::vector<Value*> indices;
-    indices.push_back(ConstantInt::get(Type::getInt64Ty(*context), 0)); // Indice per il puntatore globale
-    indices.push_back(indexInt);                                       // Indice per l'elemento
-
-    // 5. Genera l'istruzione GEP per ottenere il puntatore all'elemento.
-    Value* elemPtr = builder->CreateGEP(arrayVar->getValueType(), arrayVar, indices, "arrayidx_assign");
+    // 4. Genera l'istruzione GEP per ottenere il puntatore all'elemento.
+    Value* elemPtr = arrayelement(array, indexInt, "arrayidx_assign");
 
-    // 6. Genera l'istruzione Store.
+    // 5. Genera l'istruzione Store.
     builder->CreateStore(valueToStore, elemPtr);
 
-    // 7. L'espressione di assegnazione restituisce il valore assegnato.
+    // 6. L'espressione di assegnazione restituisce il valore assegnato.
     return valueToStore;
-}
\ No newline at end of file
+}
@@ -12,15 +12,27 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IR/GlobalVariable.h"
-
-extern llvm::LLVMContext *context;
-extern llvm::Module      *module;
-extern llvm::IRBuilder<> *builder;
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+/********************** Optimization related modules ***********************/
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+
+// Contesto, modulo e builder del driver che, nel thread corrente, sta generando il codice
+extern thread_local llvm::LLVMContext *context;
+extern thread_local llvm::Module      *module;
+extern thread_local llvm::IRBuilder<> *builder;
 
 /**************** C++ modules and generic data types ***********************/
 #include <cstdio>
 #include <cstdlib>
 #include <map>
+#include <set>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <variant>
@@ -29,6 +41,9 @@ extern llvm::IRBuilder<> *builder;
 
 using namespace llvm;
 Value* LogErrorV(const std::string& Str);
+Type *LLVMType(KType T);                        // Tipo LLVM corrispondente a T
+Value *ConvertToType(Value *V, Type *T);        // Conversione int <-> double
+Value *CreateCondition(Value *V, const Twine &Name); // V != 0, come i1
 
 // Dichiarazione del prototipo yylex per Flex
 // Flex va proprio a cercare YY_DECL perché
@@ -38,24 +53,259 @@ Value* LogErrorV(const std::string& Str);
 // Per il parser è sufficiente una forward declaration
 YY_DECL;
 
+// Tempi (in millisecondi) e memoria di una fase della compilazione o di un passo
+// di ottimizzazione: tempo reale, tempo di CPU del thread, picco della memoria
+// residente del processo (in KB) al termine della fase, numero di esecuzioni
+struct phasestats {
+  double wall = 0;
+  double cpu = 0;
+  long rss = 0;
+  unsigned count = 0;
+};
+
+// Cache di compilazione su disco (--cache-dir), condivisa fra processi e thread.
+// Ogni voce è un file della directory il cui nome è l'hash (SHA-1, esadecimale) di
+// tutto ciò da cui dipende il risultato: versione del compilatore, opzioni, sorgente.
+// Le voci sono scritte in un file temporaneo e poi rinominate, così che un lettore
+// concorrente veda la voce completa oppure nessuna; ogni lettura ne aggiorna la data
+// di modifica e, quando la directory supera limit byte, le voci usate meno di
+// recente vengono eliminate
+class compilecache {
+public:
+  compilecache(const std::string &dir, uint64_t limit);
+  bool ok() const { return !dir.empty(); }
+  std::string key(ArrayRef<StringRef> parts) const;
+  std::unique_ptr<MemoryBuffer> get(const std::string &key) const;
+  void put(const std::string &key, StringRef data) const;
+private:
+  std::string dir;
+  uint64_t limit;
+  std::string version;  // Identità dell'eseguibile kcomp e della versione di LLVM
+  mutable std::mutex lock;
+  mutable uint64_t used;  // Dimensione della directory, secondo questo processo
+  mutable bool measured;
+  void evict() const;
+};
+
+// Tabella indicizzata dai simboli: il valore associato a un simbolo sta nella
+// posizione id() di un vettore, senza confronti fra nomi. Si usa come una std::map
+// (operator[] inserisce il valore predefinito, count, erase), ma clear costa O(1):
+// gli elementi scritti prima dell'ultimo clear (di una generazione precedente)
+// valgono come assenti
+template <typename T> class symtable {
+  struct entry {
+    unsigned gen;
+    T val;
+  };
+  std::vector<entry> V;
+  unsigned gen = 1;
+public:
+  T &operator[](symbol S) {
+    if (S.id() >= V.size())
+      V.resize(S.id() + 1, entry{0, T()});
+    entry &E = V[S.id()];
+    if (E.gen != gen)
+      E = entry{gen, T()};
+    return E.val;
+  }
+  bool count(symbol S) const { return S.id() < V.size() && V[S.id()].gen == gen; }
+  T lookup(symbol S) const { return count(S) ? V[S.id()].val : T(); }
+  void erase(symbol S) { if (count(S)) V[S.id()].gen = 0; }
+  void clear() { gen++; }
+};
+
 // Classe che organizza e gestisce il processo di compilazione
 class driver
 {
 public:
   driver();
-  std::map<std::string, AllocaInst*> NamedValues; // Tabella associativa in cui ogni 
+  symtable<AllocaInst*> NamedValues; // Tabella associativa in cui ogni 
             // chiave x è una variabile e il cui corrispondente valore è un'istruzione 
             // che alloca uno spazio di memoria della dimensione necessaria per 
-            // memorizzare un variabile del tipo di x (nel nostro caso solo double)
+            // memorizzare un variabile del tipo di x (double oppure int)
+  // Tabella dei simboli: lo scanner interna ogni identificatore, così che il parser,
+  // l'AST e il codegen lavorino con symbol (un puntatore e un numero) invece che con
+  // stringhe. I simboli restano validi quanto il driver (anche fra gli elementi del REPL)
+  symbol intern (StringRef Name);
   RootAST* root;      // A fine parsing "punta" alla radice dell'AST
-  int parse (const std::string& f);
+  int parse (const std::string& f, unsigned line = 1);
+  std::string source; // Testo da analizzare al posto del file f (REPL, --incremental)
+  std::vector<yy::location> itemlocs; // Posizione nel testo di ciascun elemento di root
+  int load (const std::string& f);  // Lettura di un modulo bitcode al posto del sorgente
+  int load (const std::string& f, MemoryBufferRef buf); // Bitcode già in memoria
   std::string file;
   bool trace_parsing; // Abilita le tracce di debug el parser
   void scan_begin (); // Implementata nello scanner
   void scan_end ();   // Implementata nello scanner
+  // Testo di file (o di stdin) per lo scanner, seguito da due byte nulli: mappato in
+  // memoria (inputmap) oppure letto una volta sola (inputcopy). Resta valido fino a
+  // release_input, e le chiamate successive restituiscono lo stesso testo: con la
+  // cache kcomp lo legge prima del parsing, per calcolarne la chiave
+  MutableArrayRef<char> read_input (std::error_code &EC);
+  void release_input ();
   bool trace_scanning;// Abilita le tracce di debug nello scanner
   yy::location location; // Utillizata dallo scannar per localizzare i token
-  void codegen();
+  int optlevel;       // Livello di ottimizzazione (da 0 a 3, opzioni -O0 ... -O3)
+  std::string outfile;  // File di uscita (-o); vuoto = IR su stderr o nome derivato dal sorgente
+  std::string emitkind; // Formato di uscita (--emit): "ll", "bc", "asm" oppure "obj"
+  bool fold;          // Semplificazione dell'AST prima del codegen (disattivata da --no-fold)
+  bool hasint;        // Il programma dichiara variabili, parametri o funzioni int
+  bool assocmath;     // Aritmetica double riassociabile (--assoc-math)
+  // Moduli (file e bitcode) da cui importare le definizioni delle funzioni extern,
+  // per l'inlining fra file diversi (--import); condivisi fra i driver
+  const std::vector<std::pair<std::string, std::string>> *imports;
+  bool inlinereport;  // Raccoglie in inlined le chiamate espanse dall'inliner
+  bool lto;           // --lto: bitcode con sommario ThinLTO e ottimizzazione dopo il link
+  // Controllo degli indici degli array (--bounds-check). Nel corpo di un ciclo
+  // for (var i = S; i < E; ++i) che non modifica i ed E, i è compreso in [S, E):
+  // i controlli sugli indici i+c vengono eseguiti una volta sola prima del ciclo
+  // (in Preheader), o eliminati del tutto se S ed E sono costanti. Se non sono
+  // sempre veri, il ciclo viene generato due volte: senza quei controlli, quando
+  // Ok è vera, e con i controlli nel corpo (loop versioning)
+  bool boundscheck;
+  struct looprange {
+    Value *Start, *End;      // Estremi, dello stesso tipo (int o double)
+    Value *Counter;          // Contatore i64 di un contatore double (ciclo contato)
+    BasicBlock *Preheader;   // Blocco che termina con il salto al ciclo
+    Value *Ok;               // Controlli portati in Preheader, tutti veri (o nullptr)
+    unsigned depth;          // loopdepth fuori dal ciclo
+    // (array, c) già controllati; l'array è il suo Ptr, non il nome: un array
+    // omonimo più piccolo (in un blocco fratello o che ne nasconde uno globale)
+    // va controllato di nuovo
+    std::set<std::pair<Value*, int64_t>> checked;
+  };
+  symtable<looprange*> ranges; // Contatori dei cicli contati in generazione
+  unsigned loopdepth;       // Cicli for aperti durante il codegen
+  unsigned inlinechecks;    // Copie con i controlli nel corpo aperte: niente hoisting
+  unsigned long checksinline, checkshoisted, checksremoved; // Per --time-report
+  unsigned long loopsversioned;
+  // Array locali (var A[n]) e parametri array della funzione in generazione:
+  // puntatore al primo elemento, numero di elementi (i64), tipo degli elementi e
+  // loopdepth della dichiarazione. Per un array globale Ptr è la variabile globale
+  struct arrayref {
+    Value *Ptr, *Size;
+    Type *ElemTy;
+    unsigned depth;
+  };
+  symtable<arrayref> arrays;
+  // Array locali dei blocchi aperti, rilasciati alla fine del blocco: OnStack (i1)
+  // dice se la memoria è nella pila, altrimenti va restituita a karray_free;
+  // StackSave è il valore di llvm.stacksave per le allocazioni dinamiche in pila
+  struct arrayscope {
+    symbol Name;
+    bool hadshadowed;
+    arrayref shadowed;
+    Value *OnStack, *StackSave;
+  };
+  std::vector<arrayscope> arrayscopes;
+  uint64_t stacklimit;      // --stack-array-limit: byte oltre i quali un array va nello heap
+  symtable<PrototypeAST*> prototypes; // Per i parametri array delle chiamate
+  std::set<std::string> externals; // Funzioni e globali definite altrove (nel REPL)
+  // Profilo dei salti (PGO). Con --profile-generate ogni funzione conta quante volte
+  // viene eseguita e, per ogni salto condizionato, quante volte lo esegue e quante
+  // volte la condizione è vera; con --profile-use i conteggi raccolti in precedenza
+  // diventano pesi dei salti e conteggi d'ingresso delle funzioni
+  bool profgen;
+  std::string profuse;  // File del profilo (--profile-use)
+  void profile_begin(Function *F);          // All'inizio del corpo di F
+  BranchInst *profile_branch(BranchInst *BI); // Per ogni salto condizionato generato
+  void profile_end(Function *F);            // Al termine di F (nullptr se eliminata)
+  std::vector<std::string> inlined;
+  // Generazione dell'IR: restituisce 1 se qualche elemento non è riuscito (l'errore è
+  // già segnalato), e il modulo non va né emesso né conservato nella cache
+  unsigned errors;                      // Elementi il cui codegen non è riuscito
+  int codegen();
+  int emit();                           // Scrive il modulo nel formato richiesto
+  int emit(StringRef data);             // Scrive data (dalla cache) al posto del modulo
+  // Cache di compilazione (--cache-dir): se cachekey non è vuota emit vi conserva il
+  // risultato; cached dice se il risultato di questo file viene dalla cache
+  const compilecache *cache;
+  std::string cachekey;
+  bool cached;
+  // Compilazione incrementale (--incremental): ogni def del file f diventa un modulo
+  // a sé, conservato nella cache; i moduli vengono poi collegati in quello del driver.
+  // keyparts sono le parti della chiave comuni a tutto il file (opzioni, import, ...)
+  int compile_functions(const std::string &f, std::mutex &parsing,
+                        const std::vector<std::string> &keyparts);
+  unsigned long functionscached, functionscompiled; // Per --time-report
+  int run(const std::vector<std::string> &libs); // Esegue main con il JIT
+  // Sessione interattiva (--repl): carica i file, poi legge elementi da stdin
+  int repl(const std::vector<std::string> &files, const std::vector<std::string> &libs);
+  bool interactive;   // Nel REPL sono ammesse espressioni al livello più esterno
+  int link(driver &other);              // Unisce (in memoria) il modulo di other a questo
+  std::string bitcode();                // Il modulo serializzato in bitcode
+
+  // Creazione di un nodo dell'AST. I nodi non sono allocati singolarmente nello heap
+  // ma, uno dopo l'altro, nell'arena del driver, che li possiede tutti: l'intero
+  // albero viene rilasciato in un colpo solo da free_ast (al termine di codegen)
+  template <typename T, typename... Args>
+  T *make(Args&&... args) {
+    T *node = new (ASTArena.Allocate<T>()) T(std::forward<Args>(args)...);
+    ASTNodes.push_back(node);
+    return node;
+  }
+  void free_ast();
+  ~driver();
+  void optimize_function(Function &F); // Passi "locali", dopo verifyFunction
+  void optimize_module();               // Pipeline completa sull'intero modulo
+  // Ottimizzazione dell'intero programma (--lto), sul modulo che ha raccolto tutti
+  // gli altri: restano visibili all'esterno solo main e i simboli di exports
+  void optimize_lto(const std::vector<std::string> &exports);
+
+  // Statistiche di compilazione, raccolte solo se timing è vero (--time-report,
+  // --stats=json). Le fasi hanno nomi gerarchici: "parse.scan" è compresa in "parse"
+  bool timing;
+  bool timepasses;          // Report testuale di TimePassesHandler (--time-report)
+  unsigned long tokens;     // Token restituiti dallo scanner
+  unsigned long astnodes;   // Nodi dell'AST creati dal parser
+  double scanwall;          // Tempo reale trascorso nello scanner
+  std::map<std::string, phasestats> phases;
+  std::map<std::string, phasestats> passes;
+  std::vector<std::pair<std::string, double>> functime; // Codegen di ciascuna funzione
+  json::Value stats();
+  void time_report(raw_ostream &OS);
+private:
+  void init_passes();
+  void output(std::string &kind, std::string &out); // Formato e file di uscita di emit
+  void import_definitions();
+  std::map<std::string, std::string> imported; // Funzione importata -> file di origine
+  void read_profile();
+  void profile_module();
+  std::map<std::string, std::vector<uint64_t>> profile; // Contatori letti da profuse
+  GlobalVariable *profcounters;           // Contatori della funzione in generazione
+  const std::vector<uint64_t> *profdata;  // e relativi conteggi dal profilo
+  unsigned profnext;                      // Indice del prossimo salto della funzione
+  std::vector<std::pair<std::string, GlobalVariable*>> profiled;
+  // Contesto, modulo e builder di questo driver (dichiarati per primi perché
+  // devono essere distrutti dopo i pass manager che ne fanno riferimento)
+  std::unique_ptr<LLVMContext>   TheContext;
+  std::unique_ptr<Module>        TheModule;
+  std::unique_ptr<IRBuilder<>>   TheBuilder;
+  std::unique_ptr<TargetMachine> target;
+  BumpPtrAllocator      ASTArena; // Memoria di tutti i nodi dell'AST
+  std::vector<RootAST*> ASTNodes; // Nodi allocati, per invocarne i distruttori
+  std::unique_ptr<PassInstrumentationCallbacks> PIC;
+  std::unique_ptr<TimePassesHandler>            TPH;
+  std::vector<std::pair<double, double>>        passstart; // Passi in esecuzione
+  std::unique_ptr<LoopAnalysisManager>     LAM;
+  std::unique_ptr<FunctionAnalysisManager> FAM;
+  std::unique_ptr<CGSCCAnalysisManager>    CGAM;
+  std::unique_ptr<ModuleAnalysisManager>   MAM;
+  std::unique_ptr<PassBuilder>             PB;
+  std::unique_ptr<FunctionPassManager>     FPM;
+  std::unique_ptr<sys::fs::mapped_file_region> inputmap;
+  std::vector<char>                        inputcopy;
+  StringMap<unsigned>                      symbols;  // Nome -> id (si veda intern)
+};
+
+// Misura una fase della compilazione di drv, dalla costruzione alla distruzione
+// dell'oggetto, sommandone i tempi alla voce phase delle statistiche
+class phasetimer {
+  phasestats *ps;
+  double wall, cpu;
+public:
+  phasetimer(driver &drv, const char *phase);
+  ~phasetimer();
 };
 
 typedef std::variant<std::string,double> lexval;
@@ -68,24 +318,42 @@ public:
   virtual ~RootAST() {};
   virtual lexval getLexVal() const {return NONE;};
   virtual Value *codegen(driver& drv) { return nullptr; };
+  // Semplificazione (constant folding) del sottoalbero, prima del codegen:
+  // restituisce il nodo che sostituisce questo (eventualmente se stesso)
+  virtual RootAST *fold(driver& drv) { return this; };
+  // Vero se il sottoalbero può modificare la variabile Name (assegnamenti, ++, --)
+  // o ne dichiara una omonima, che nasconderebbe quella esterna
+  virtual bool assigns(symbol Name) const { return false; };
 };
 
 class GlobalDeclAST;
 class AssignExprAST;
 
-// Classe che rappresenta la sequenza di statement
+// Classe che rappresenta la sequenza degli elementi (definizioni, dichiarazioni
+// extern e global) al livello più esterno del programma, memorizzati in un vettore
 class SeqAST : public RootAST {
 private:
-  RootAST* first;
-  RootAST* continuation;
+  std::vector<RootAST*> items;
 
 public:
-  SeqAST(RootAST* first, RootAST* continuation);
+  SeqAST(std::vector<RootAST*> items);
+  const std::vector<RootAST*> &getItems() const { return items; }
+  RootAST *fold(driver& drv) override;
   Value *codegen(driver& drv) override;
 };
 
 /// ExprAST - Classe base per tutti i nodi espressione
-class ExprAST : public RootAST {};
+class ExprAST : public RootAST {
+public:
+  ExprAST *fold(driver& drv) override { return this; };
+  // Codice di un'espressione usata come condizione: anziché produrne il valore
+  // salta a TrueBB se è vera (diversa da zero), a FalseBB altrimenti
+  virtual Value *condcodegen(driver& drv, BasicBlock *TrueBB, BasicBlock *FalseBB);
+  // Codice di un'espressione in posizione di coda (il corpo di una funzione):
+  // ogni cammino termina con il return del proprio valore, così che una chiamata
+  // ricorsiva preceda direttamente l'istruzione ret
+  virtual Value *tailcodegen(driver& drv);
+};
 
 /// NumberExprAST - Classe per la rappresentazione di costanti numeriche
 class NumberExprAST : public ExprAST {
@@ -94,6 +362,7 @@ private:
 
 public:
   NumberExprAST(double Val);
+  double getVal() const { return Val; };
   lexval getLexVal() const override;
   Value *codegen(driver& drv) override;
 };
@@ -101,10 +370,11 @@ public:
 /// VariableExprAST - Classe per la rappresentazione di riferimenti a variabili
 class VariableExprAST : public ExprAST {
 private:
-  std::string Name;
+  symbol Name;
   
 public:
-  VariableExprAST(const std::string &Name);
+  VariableExprAST(symbol Name);
+  symbol getName() const { return Name; };
   lexval getLexVal() const override;
   Value *codegen(driver& drv) override;
 };
@@ -118,18 +388,26 @@ private:
 
 public:
   BinaryExprAST(char Op, ExprAST* LHS, ExprAST* RHS);
+  char getOp() const { return Op; };
+  ExprAST *getLHS() const { return LHS; };
+  ExprAST *getRHS() const { return RHS; };
+  ExprAST *fold(driver& drv) override;
+  bool assigns(symbol Name) const override;
   Value *codegen(driver& drv) override;
+  Value *condcodegen(driver& drv, BasicBlock *TrueBB, BasicBlock *FalseBB) override;
 };
 
 /// CallExprAST - Classe per la rappresentazione di chiamate di funzione
 class CallExprAST : public ExprAST {
 private:
-  std::string Callee;
+  symbol Callee;
   std::vector<ExprAST*> Args;  // ASTs per la valutazione degli argomenti
 
 public:
-  CallExprAST(std::string Callee, std::vector<ExprAST*> Args);
+  CallExprAST(symbol Callee, std::vector<ExprAST*> Args);
   lexval getLexVal() const override;
+  ExprAST *fold(driver& drv) override;
+  bool assigns(symbol Name) const override;
   Value *codegen(driver& drv) override;
 };
 
@@ -141,7 +419,10 @@ private:
   ExprAST* FalseExp;
 public:
   IfExprAST(ExprAST* Cond, ExprAST* TrueExp, ExprAST* FalseExp);
+  ExprAST *fold(driver& drv) override;
+  bool assigns(symbol Name) const override;
   Value *codegen(driver& drv) override;
+  Value *tailcodegen(driver& drv) override;
 };
 
 
@@ -157,6 +438,8 @@ public:
     ForExprAST(VarBindingAST* StartVar, ExprAST* StartExpr, ExprAST* Cond, 
                ExprAST* Step, ExprAST* Body);
     
+    ExprAST* fold(driver& drv) override;
+    bool assigns(symbol Name) const override;
     Value* codegen(driver& drv) override;
 };
 
@@ -166,7 +449,12 @@ private:
   ExprAST* Operand;
 public:
   UnaryExprAST(char Op, ExprAST* Operand);
+  char getOp() const { return Op; };
+  ExprAST *getOperand() const { return Operand; };
+  ExprAST *fold(driver& drv) override;
+  bool assigns(symbol Name) const override;
   Value *codegen(driver& drv) override;
+  Value *condcodegen(driver& drv, BasicBlock *TrueBB, BasicBlock *FalseBB) override;
 };
 
 
@@ -177,6 +465,8 @@ private:
   ExprAST* ElseBranch;  // Nome corretto (può essere nullptr)
 public:
   IfStmtAST(ExprAST* Cond, ExprAST* ThenBranch, ExprAST* ElseBranch);
+  ExprAST *fold(driver& drv) override;
+  bool assigns(symbol Name) const override;
   Value *codegen(driver& drv) override;
 };
 
@@ -190,33 +480,60 @@ public:
     : Stmts(std::move(Stmts)),
       RetExpr(RetExpr)
   {}
+  ExprAST *fold(driver& drv) override;
+  bool assigns(symbol Name) const override;
   Value *codegen(driver& drv) override;
+  Value *tailcodegen(driver& drv) override;
 };
 
 /// VarBindingAST
 class VarBindingAST: public RootAST {
 private:
-  const std::string Name;
+  const symbol Name;
   ExprAST* Val;
+  KType T;
 public:
-  VarBindingAST(const std::string Name, ExprAST* Val);
+  VarBindingAST(symbol Name, ExprAST* Val, KType T = KType::Double);
+  VarBindingAST *fold(driver& drv) override;
+  bool assigns(symbol N) const override;
   AllocaInst *codegen(driver& drv) override;
-  const std::string& getName() const;
+  symbol getName() const;
+  ExprAST *getVal() const { return Val; };
+};
+
+/// ArrayBindingAST - Dichiarazione di un array locale (var A[n]), con n calcolato
+/// a tempo di esecuzione. Gli elementi valgono inizialmente 0; la memoria, nella
+/// pila oppure nello heap (si veda ArrayBindingAST::codegen), viene rilasciata
+/// alla fine del blocco che contiene la dichiarazione
+class ArrayBindingAST: public RootAST {
+private:
+  const symbol Name;
+  ExprAST* Size;
+  KType T;
+public:
+  ArrayBindingAST(symbol Name, ExprAST* Size, KType T = KType::Double);
+  ArrayBindingAST *fold(driver& drv) override;
+  bool assigns(symbol N) const override;
+  Value *codegen(driver& drv) override;
 };
 
 /// PrototypeAST - Classe per la rappresentazione dei prototipi di funzione
-/// (nome, numero e nome dei parametri; in questo caso il tipo è implicito
-/// perché unico)
+/// (nome, tipo del risultato, nome e tipo dei parametri)
 class PrototypeAST : public RootAST {
 private:
-  std::string Name;
-  std::vector<std::string> Args;
+  symbol Name;
+  std::vector<KParam> Args;
+  KType RetType;
   bool emitcode;
 
 public:
-  PrototypeAST(std::string Name, std::vector<std::string> Args);
-  const std::vector<std::string> &getArgs() const;
+  PrototypeAST(symbol Name, std::vector<KParam> Args,
+               KType RetType = KType::Double);
+  const std::vector<KParam> &getArgs() const;
+  symbol getName() const { return Name; }
+  KType getRetType() const { return RetType; }
   lexval getLexVal() const override;
+  FunctionType *functype() const;
   Function *codegen(driver& drv) override;
   void noemit();
 };
@@ -230,76 +547,97 @@ private:
   
 public:
   FunctionAST(PrototypeAST* Proto, ExprAST* Body);
+  PrototypeAST *getProto() const { return Proto; }
+  RootAST *fold(driver& drv) override;
   Function *codegen(driver& drv) override;
 };
 
 
 class GlobalDeclAST : public RootAST {
-  std::string Name;
+  symbol Name;
   int ArraySize; // 0 o valore negativo se non è un array, >0 se è un array
+  KType T;       // Tipo della variabile o degli elementi dell'array
 
 public:
   // Costruttore modificato
-  GlobalDeclAST(const std::string &N, int size = 0) : Name(N), ArraySize(size) {}
+  GlobalDeclAST(symbol N, int size = 0, KType T = KType::Double)
+    : Name(N), ArraySize(size), T(T) {}
   
   bool isArray() const { return ArraySize > 0; }
   int getArraySize() const { return ArraySize; }
-  const std::string& getName() const { return Name; }
+  symbol getName() const { return Name; }
+  KType getType() const { return T; }
 
   Value *codegen(driver& drv) override; // Il codegen dovrà essere modificato
 };
 class AssignExprAST : public ExprAST {
-  std::string LHS;
+  symbol LHS;
   ExprAST *RHS;
 public:
-  AssignExprAST(const std::string &L, ExprAST *R) : LHS(L), RHS(R) {}
+  AssignExprAST(symbol L, ExprAST *R) : LHS(L), RHS(R) {}
+  ExprAST *fold(driver& drv) override { RHS = RHS->fold(drv); return this; }
+  bool assigns(symbol Name) const override {
+    return LHS == Name || RHS->assigns(Name);
+  }
   Value *codegen(driver& drv) override {
     Value *V = RHS->codegen(drv);
     if (!V) return nullptr;
     // locale?
     if (AllocaInst *A = drv.NamedValues[LHS]) {
+      V = ConvertToType(V, A->getAllocatedType());
       builder->CreateStore(V, A);
       return V;
     }
     // globale?
-    if (GlobalVariable *G = module->getGlobalVariable(LHS)) {
+    if (GlobalVariable *G = module->getGlobalVariable(LHS.name())) {
+      V = ConvertToType(V, G->getValueType());
       builder->CreateStore(V, G);
       return V;
     }
-    return LogErrorV("Variabile non definita: "+LHS);
+    return LogErrorV("Variabile non definita: "+LHS.str());
   }
 };
 
 class ArrayAccessExprAST : public ExprAST {
 private:
-  std::string ArrayName;
+  symbol ArrayName;
   ExprAST* IndexExpr;
 
 public:
-  ArrayAccessExprAST(const std::string &arrayName, ExprAST* indexExpr)
+  ArrayAccessExprAST(symbol arrayName, ExprAST* indexExpr)
     : ArrayName(arrayName), IndexExpr(indexExpr) {}
 
-  const std::string& getArrayName() const { return ArrayName; } // Utile per il debug o info
+  symbol getArrayName() const { return ArrayName; } // Utile per il debug o info
   ExprAST* getIndexExpr() const { return IndexExpr; }
 
+  ExprAST *fold(driver& drv) override { IndexExpr = IndexExpr->fold(drv); return this; }
+  bool assigns(symbol Name) const override { return IndexExpr->assigns(Name); }
   Value *codegen(driver& drv) override;
 };
 
 class ArrayAssignExprAST : public ExprAST {
 private:
-  std::string ArrayName;
+  symbol ArrayName;
   ExprAST* IndexExpr;
   ExprAST* ValueExpr; // L'espressione da assegnare (RHS)
 
 public:
-  ArrayAssignExprAST(const std::string &arrayName, ExprAST* indexExpr, ExprAST* valueExpr)
+  ArrayAssignExprAST(symbol arrayName, ExprAST* indexExpr, ExprAST* valueExpr)
     : ArrayName(arrayName), IndexExpr(indexExpr), ValueExpr(valueExpr) {}
 
   // Eventuali getter se necessari per debug
-  // const std::string& getArrayName() const { return ArrayName; }
+  // symbol getArrayName() const { return ArrayName; }
   // ExprAST* getIndexExpr() const { return IndexExpr; }
   // ExprAST* getValueExpr() const { return ValueExpr; }
 
+  ExprAST *fold(driver& drv) override {
+    IndexExpr = IndexExpr->fold(drv);
+    ValueExpr = ValueExpr->fold(drv);
+    return this;
+  }
+  bool assigns(symbol Name) const override {
+    return IndexExpr->assigns(Name) || ValueExpr->assigns(Name);
+  }
   Value *codegen(driver& drv) override;
 };
 
@@ -0,0 +1,76 @@
+// karray: allocatore degli array locali (var A[n]) troppo grandi per la pila,
+// da collegare ai programmi compilati da kcomp come time_and_print.cpp (kcomp lo
+// contiene già per --run).
+//
+// I blocchi sono raggruppati in classi di dimensione (potenze di due, da 64 byte a
+// 64 MB): un blocco rilasciato resta nella lista della sua classe e viene riusato
+// dalla successiva allocazione della stessa classe, così che un array dichiarato in
+// una funzione chiamata molte volte non richieda ogni volta malloc e free. Ogni
+// thread ha il proprio pool, senza sincronizzazione; i blocchi più grandi passano
+// direttamente per calloc e free
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+const int minclass = 6, maxclass = 26;   // 64 byte ... 64 MB
+const int maxcached = 8;                 // Blocchi conservati per classe
+
+struct pool {
+  void *blocks[maxclass + 1][maxcached];
+  int count[maxclass + 1] = {};
+  ~pool() {
+    for (int c = minclass; c <= maxclass; c++)
+      while (count[c] > 0)
+        std::free(blocks[c][--count[c]]);
+  }
+};
+
+thread_local pool thepool;
+
+// Classe di un blocco di bytes byte, oppure -1 se il blocco è troppo grande
+int sizeclass(uint64_t bytes) {
+  int c = minclass;
+  while (c <= maxclass && (uint64_t(1) << c) < bytes) c++;
+  return c <= maxclass ? c : -1;
+}
+
+bool size(int64_t n, int64_t elemsize, uint64_t &bytes) {
+  return n >= 0 && elemsize > 0 && !__builtin_mul_overflow((uint64_t) n, (uint64_t) elemsize, &bytes);
+}
+}
+
+extern "C" {
+
+// n elementi di elemsize byte, azzerati
+void *karray_alloc(int64_t n, int64_t elemsize) {
+  uint64_t bytes;
+  if (!size(n, elemsize, bytes)) {
+    fprintf(stderr, "karray: dimensione dell'array non valida: %lld\n", (long long) n);
+    abort();
+  }
+  int c = sizeclass(bytes);
+  void *p;
+  if (c >= 0 && thepool.count[c] > 0) {
+    p = thepool.blocks[c][--thepool.count[c]];
+    memset(p, 0, bytes);
+  } else
+    p = calloc(1, c >= 0 ? uint64_t(1) << c : bytes);
+  if (!p) {
+    fprintf(stderr, "karray: memoria esaurita (%llu byte)\n", (unsigned long long) bytes);
+    abort();
+  }
+  return p;
+}
+
+void karray_free(void *p, int64_t n, int64_t elemsize) {
+  uint64_t bytes;
+  int c = size(n, elemsize, bytes) ? sizeclass(bytes) : -1;
+  if (c >= 0 && thepool.count[c] < maxcached)
+    thepool.blocks[c][thepool.count[c]++] = p;
+  else
+    free(p);
+}
+
+}
@@ -1,24 +1,366 @@
+#include <chrono>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sys/resource.h>
 #include "driver.hpp"
-
-extern LLVMContext *context;
-extern Module *module;
-extern IRBuilder<> *builder;
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
 
 int main (int argc, char *argv[]) {
+  auto start = std::chrono::steady_clock::now();
   int res = 0;
-  driver drv;
+  bool trace_parsing = false;
+  bool trace_scanning = false;
+  int optlevel = 0;
+  std::string outfile, emitkind;
+  bool run = false;              // --run: esecuzione diretta di main con il JIT
+  bool repl = false;             // --repl: sessione interattiva con il JIT
+  std::vector<std::string> libs; // --lib: librerie in cui cercare le funzioni extern
+  unsigned jobs = 1;             // -j: numero di file compilati in parallelo
+  bool timereport = false;       // --time-report: tempi per fase su stderr
+  bool statsjson = false;        // --stats=json: statistiche in JSON su stdout
+  bool fold = true;              // --no-fold: nessuna semplificazione dell'AST
+  bool assocmath = false;        // --assoc-math: somme e prodotti double riassociabili
+  std::vector<std::string> importfiles; // --import: file (.k o .bc) da cui importare funzioni
+  bool inlinereport = false;     // --inline-report: chiamate espanse dall'inliner su stderr
+  bool lto = false;              // --lto: ottimizzazione dell'intero programma
+  std::vector<std::string> exports; // --export: simboli che --lto non rende interni
+  bool profgen = false;          // --profile-generate: conteggio di chiamate e salti
+  std::string profuse;           // --profile-use: profilo raccolto in precedenza
+  bool boundscheck = false;      // --bounds-check: controllo degli indici degli array
+  long stacklimit = -1;          // --stack-array-limit: byte degli array locali nella pila
+  std::string cachedir;          // --cache-dir: cache dei risultati fra un'esecuzione e l'altra
+  uint64_t cachesize = 256 << 20; // --cache-size: dimensione massima della cache in byte
+  bool incremental = false;      // --incremental: cache di ogni singola def
+  std::vector<const char*> llvmargs = {argv[0]}; // Opzioni passate a LLVM (--inline-threshold)
+  std::vector<std::string> files;
   int i = 1;
   while (i<argc) {
     if (argv[i] == std::string ("-p"))
-      drv.trace_parsing = true; // Abilita tracce debug nel parser
+      trace_parsing = true;     // Abilita tracce debug nel parser
     else if (argv[i] == std::string ("-s"))
-      drv.trace_scanning = true;// Abilita tracce debug nello scanner
-    else  if (!drv.parse(argv[i])) { // Parsing e creazione dell'AST
-      drv.codegen();                 // Visita AST e generazione dell'IR (su stderr)
-    } else
-      res = 1;
+      trace_scanning = true;    // Abilita tracce debug nello scanner
+    else if (argv[i][0] == '-' && argv[i][1] == 'O' &&
+             argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == '\0')
+      optlevel = argv[i][2] - '0'; // Livello di ottimizzazione (-O0 ... -O3)
+    else if (argv[i] == std::string ("--run"))
+      run = true;
+    else if (argv[i] == std::string ("--repl"))
+      repl = true;
+    else if (argv[i] == std::string ("--lib") && i+1<argc)
+      libs.push_back(argv[++i]);
+    else if (argv[i] == std::string ("-o") && i+1<argc)
+      outfile = argv[++i];       // File di uscita (formato dedotto dall'estensione)
+    else if (argv[i] == std::string ("-S"))
+      emitkind = "asm";
+    else if (std::string(argv[i]).rfind("--emit=", 0) == 0) {
+      emitkind = std::string(argv[i]).substr(7);
+      if (emitkind != "ll" && emitkind != "bc" && emitkind != "asm" && emitkind != "obj") {
+        std::cerr << "Formato di emissione sconosciuto: " << emitkind << '\n';
+        return 1;
+      }
+    }
+    else if (argv[i][0] == '-' && argv[i][1] == 'j') {
+      const char *n = argv[i][2] ? argv[i]+2 : (i+1<argc ? argv[++i] : "0");
+      jobs = atoi(n);            // -j N oppure -jN; -j 0 = tutti i core disponibili
+      if (jobs == 0) jobs = llvm::hardware_concurrency().compute_thread_count();
+    }
+    else if (argv[i] == std::string ("--time-report"))
+      timereport = true;
+    else if (argv[i] == std::string ("--stats=json"))
+      statsjson = true;
+    else if (argv[i] == std::string ("--no-fold"))
+      fold = false;
+    else if (argv[i] == std::string ("--assoc-math"))
+      assocmath = true;
+    else if (argv[i] == std::string ("--import") && i+1<argc)
+      importfiles.push_back(argv[++i]);
+    else if (argv[i] == std::string ("--lto"))
+      lto = true;
+    else if (std::string(argv[i]).rfind("--export=", 0) == 0)
+      exports.push_back(std::string(argv[i]).substr(9));
+    else if (argv[i] == std::string ("--profile-generate"))
+      profgen = true;
+    else if (std::string(argv[i]).rfind("--profile-use=", 0) == 0)
+      profuse = std::string(argv[i]).substr(14);
+    else if (argv[i] == std::string ("--bounds-check"))
+      boundscheck = true;
+    else if (std::string(argv[i]).rfind("--stack-array-limit=", 0) == 0)
+      stacklimit = atol(argv[i]+20);
+    else if (std::string(argv[i]).rfind("--cache-dir=", 0) == 0)
+      cachedir = argv[i]+12;
+    else if (argv[i] == std::string ("--incremental"))
+      incremental = true;
+    else if (std::string(argv[i]).rfind("--cache-size=", 0) == 0)
+      cachesize = strtoull(argv[i]+13, nullptr, 10);
+    else if (argv[i] == std::string ("--inline-report"))
+      inlinereport = true;
+    else if (std::string(argv[i]).rfind("--inline-threshold=", 0) == 0)
+      llvmargs.push_back(argv[i]+1); // -inline-threshold=N, come con clang -mllvm
+    else
+      files.push_back(argv[i]);
     i++;
   };
+  // La soglia dell'inliner è un'opzione di LLVM, comune a tutto il processo
+  if (llvmargs.size() > 1)
+    llvm::cl::ParseCommandLineOptions(llvmargs.size(), llvmargs.data());
+
+  // Le definizioni da importare sono preparate una volta sola, in bitcode, e poi
+  // condivise da tutti i driver: un file .bc (per esempio prodotto in precedenza
+  // con -o x.bc) viene letto così com'è, un file .k compilato con le stesse opzioni
+  std::vector<std::pair<std::string, std::string>> imports;
+  for (const std::string &f : importfiles) {
+    if (llvm::sys::path::extension(f) == ".bc") {
+      auto buf = llvm::MemoryBuffer::getFile(f);
+      if (!buf) {
+        std::cerr << "cannot open " << f << ": " << buf.getError().message() << '\n';
+        return 1;
+      }
+      imports.emplace_back(f, (*buf)->getBuffer().str());
+    } else {
+      driver drv;
+      drv.optlevel = optlevel;
+      drv.fold = fold;
+      drv.assocmath = assocmath;
+      drv.boundscheck = boundscheck;
+      if (stacklimit >= 0) drv.stacklimit = stacklimit;
+      if (drv.parse(f))
+        return 1;
+      if (drv.codegen())
+        return 1;
+      imports.emplace_back(f, drv.bitcode());
+    }
+  }
+
+  // Con --repl i file indicati vengono caricati nella sessione, che prosegue poi
+  // con le definizioni e le espressioni lette da stdin
+  if (repl) {
+    driver drv;
+    drv.trace_parsing = trace_parsing;
+    drv.trace_scanning = trace_scanning;
+    drv.optlevel = optlevel;
+    drv.fold = fold;
+    drv.assocmath = assocmath;
+    drv.imports = imports.empty() ? nullptr : &imports;
+    drv.boundscheck = boundscheck;
+    if (stacklimit >= 0) drv.stacklimit = stacklimit;
+    return drv.repl(files, libs);
+  }
+
+  // Con --lto e un'uscita unica (-o oppure --run) i moduli, anche uno solo, vengono
+  // uniti e ottimizzati come un unico programma; senza, ogni file diventa un .bc
+  // con sommario ThinLTO, da passare in seguito a kcomp --lto o a clang++ -flto=thin
+  bool wholeprogram = lto && (run || !outfile.empty());
+  if (lto && !wholeprogram && emitkind.empty())
+    emitkind = "bc";
+
+  // Ogni file ha un proprio driver (e dunque un proprio contesto e modulo LLVM).
+  // Se più file devono confluire in un'unica uscita (-o oppure --run) i moduli
+  // vengono collegati in memoria al termine; altrimenti ogni file viene emesso
+  // dal thread che lo ha compilato, appena pronto. Fa eccezione l'IR su stderr,
+  // emesso alla fine e nell'ordine dei file per non mescolare le uscite
+  std::vector<std::unique_ptr<driver>> drivers;
+  for (size_t k = 0; k < files.size(); k++) {
+    drivers.push_back(std::make_unique<driver>());
+    driver &drv = *drivers.back();
+    drv.trace_parsing = trace_parsing;
+    drv.trace_scanning = trace_scanning;
+    drv.optlevel = optlevel;
+    drv.outfile = outfile;
+    drv.emitkind = emitkind;
+    drv.fold = fold;
+    drv.assocmath = assocmath;
+    drv.imports = imports.empty() ? nullptr : &imports;
+    drv.inlinereport = inlinereport;
+    drv.lto = lto;
+    drv.profgen = profgen;
+    drv.profuse = profuse;
+    drv.boundscheck = boundscheck;
+    if (stacklimit >= 0) drv.stacklimit = stacklimit;
+    drv.timing = timereport || statsjson;
+    drv.timepasses = timereport;
+  }
+  bool link = files.size() > 1 && (run || !outfile.empty());
+  bool tostderr = !run && outfile.empty() && emitkind.empty();
+
+  // La cache (--cache-dir, oppure la variabile d'ambiente KCOMP_CACHE_DIR) conserva,
+  // per ogni sorgente, il file emesso o, se i moduli vanno ancora collegati o eseguiti,
+  // il bitcode già ottimizzato. La chiave comprende le opzioni che influiscono sul
+  // codice, il contenuto del profilo e dei moduli importati, nome e testo del sorgente.
+  // L'IR su stderr e --inline-report (che descrive l'inlining mentre avviene) non
+  // usano la cache
+  if (cachedir.empty() && getenv("KCOMP_CACHE_DIR"))
+    cachedir = getenv("KCOMP_CACHE_DIR");
+  std::unique_ptr<compilecache> cache;
+  std::vector<std::string> cacheparts;
+  if (!cachedir.empty() && !tostderr && !inlinereport) {
+    cache = std::make_unique<compilecache>(cachedir, cachesize);
+    if (!cache->ok())
+      cache.reset();
+  }
+  if (incremental && !cache) {
+    std::cerr << "--incremental ignorata: serve la cache (--cache-dir)\n";
+    incremental = false;
+  }
+  if (cache) {
+    std::string flags = llvm::formatv("-O{0} fold={1} assoc={2} bounds={3} stack={4} "
+                                      "lto={5} profgen={6} emit={7} out={8} incr={9}", optlevel,
+                                      fold, assocmath, boundscheck, stacklimit, lto, profgen,
+                                      emitkind, llvm::sys::path::extension(outfile),
+                                      incremental).str();
+    for (size_t a = 1; a < llvmargs.size(); a++)
+      flags += std::string(" ") + llvmargs[a];
+    cacheparts.push_back(flags);
+    if (!profuse.empty()) {
+      auto buf = llvm::MemoryBuffer::getFile(profuse);
+      cacheparts.push_back(buf ? (*buf)->getBuffer().str() : "");
+    }
+    for (auto &[name, code] : imports) {
+      cacheparts.push_back(name);
+      cacheparts.push_back(code);
+    }
+    for (auto &drv : drivers)
+      drv->cache = cache.get();
+  }
+  std::vector<int> failed(files.size(), 0);
+  std::mutex parsing;            // Lo scanner generato da flex non è rientrante
+  std::vector<std::string> reports(files.size());
+  std::vector<json::Value> stats(files.size(), nullptr);
+  std::vector<std::string> inlinelog(files.size());
+
+  // Le statistiche di un file vengono raccolte prima di rilasciarne il driver
+  auto collect = [&](size_t k) {
+    if (timereport) {
+      raw_string_ostream OS(reports[k]);
+      drivers[k]->time_report(OS);
+    }
+    if (statsjson)
+      stats[k] = drivers[k]->stats();
+  };
+
+  auto compile = [&](size_t k) {
+    driver &drv = *drivers[k];
+    int r;
+    bool bitcode = llvm::sys::path::extension(files[k]) == ".bc";
+    bool emitnow = !link && !wholeprogram && !run && !tostderr;
+    // Con la cache il sorgente viene letto per primo, per calcolarne la chiave: se la
+    // voce esiste parsing, codegen e ottimizzazione non servono più. Altrimenti lo
+    // scanner analizza lo stesso testo (read_input lo conserva), senza rileggerlo
+    std::string key;
+    if (cache && !bitcode) {
+      std::error_code ec;
+      drv.file = files[k];
+      MutableArrayRef<char> text = drv.read_input(ec);
+      if (!ec) {
+        std::vector<StringRef> parts(cacheparts.begin(), cacheparts.end());
+        parts.push_back(emitnow ? "emit" : "module");
+        parts.push_back(files[k]);
+        parts.push_back(StringRef(text.data(), text.size() - 2));  // Senza i byte nulli
+        key = cache->key(parts);
+      }
+    }
+    if (!key.empty())
+      if (std::unique_ptr<llvm::MemoryBuffer> hit = cache->get(key)) {
+        drv.release_input();
+        drv.cached = true;
+        if (emitnow) {
+          failed[k] = drv.emit(hit->getBuffer());
+          collect(k);
+          drivers[k].reset();
+          return;
+        }
+        if (drv.load(files[k], *hit) == 0)
+          return;
+        drv.cached = false;      // Voce illeggibile: il file viene ricompilato
+      }
+    bool functions = incremental && !key.empty();
+    if (bitcode)
+      r = drv.load(files[k]);    // Modulo già compilato (per esempio da kcomp --lto)
+    else if (functions)          // Le def non modificate vengono prese dalla cache
+      r = drv.compile_functions(files[k], parsing, cacheparts);
+    else {
+      std::lock_guard<std::mutex> lock(parsing);
+      r = drv.parse(files[k]);   // Parsing e creazione dell'AST
+    }
+    if (r) {
+      failed[k] = 1;
+      return;
+    }
+    // Visita AST e generazione dell'IR: un file con errori non viene né emesso né
+    // conservato nella cache
+    if (!bitcode && !functions && drv.codegen()) {
+      failed[k] = 1;
+      return;
+    }
+    for (const std::string &m : drv.inlined)
+      inlinelog[k] += files[k] + ": " + m + "\n";
+    if (emitnow) {
+      drv.cachekey = key;        // emit conserva nella cache il file prodotto
+      failed[k] = drv.emit();    // Emissione del codice nel formato richiesto
+      collect(k);
+      drivers[k].reset();
+    } else if (!key.empty())
+      cache->put(key, drv.bitcode());
+  };
+  if (jobs <= 1 || files.size() <= 1)
+    for (size_t k = 0; k < files.size(); k++)
+      compile(k);
+  else {
+    llvm::ThreadPool pool(llvm::hardware_concurrency(jobs));
+    for (size_t k = 0; k < files.size(); k++)
+      pool.async(compile, k);
+    pool.wait();
+  }
+  for (int f : failed)
+    if (f) res = 1;
+
+  if (res == 0 && link)
+    for (size_t k = 1; k < drivers.size() && res == 0; k++)
+      res = drivers[0]->link(*drivers[k]);
+  if (res == 0 && wholeprogram && !files.empty())
+    drivers[0]->optimize_lto(exports);
+  if (res == 0 && !files.empty()) {
+    if (run)
+      res = drivers[0]->run(libs);
+    else if (tostderr)
+      for (auto &drv : drivers)
+        drv->emit();             // IR su stderr, file per file
+    else if (link || wholeprogram)
+      res = drivers[0]->emit();
+  }
+
+  for (const std::string &l : inlinelog)
+    errs() << l;
+  if (!timereport && !statsjson)
+    return res;
+  for (size_t k = 0; k < drivers.size(); k++)
+    if (drivers[k])
+      collect(k);
+  rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  double wall = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start).count();
+  if (timereport) {
+    for (const std::string &r : reports)
+      errs() << r;
+    errs() << format("===== kcomp total: %.3f ms wall, peak RSS %ld KB, %u thread(s) =====\n",
+                     wall, ru.ru_maxrss, jobs);
+  }
+  if (statsjson) {
+    json::Array filestats;
+    for (json::Value &v : stats)
+      if (v.kind() != json::Value::Null)
+        filestats.push_back(std::move(v));
+    outs() << formatv("{0:2}", json::Value(json::Object{
+        {"files", std::move(filestats)},
+        {"jobs", jobs},
+        {"wall_ms", wall},
+        {"peak_rss_kb", (int64_t) ru.ru_maxrss}})) << "\n";
+  }
   return res;
 }
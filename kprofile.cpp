@@ -0,0 +1,88 @@
+// kprofile: supporto a tempo di esecuzione per i programmi compilati con
+// kcomp --profile-generate, da collegare al programma come time_and_print.cpp (kcomp
+// lo contiene già per --run).
+//
+// Il costruttore di ogni modulo registra i contatori delle sue funzioni; all'uscita
+// del programma i conteggi vengono sommati a quelli già presenti nel file del profilo
+// (la variabile d'ambiente KPROFILE, altrimenti default.kprof), così che più
+// esecuzioni producano un unico profilo da passare a kcomp --profile-use=FILE.
+// Il file è testuale: una riga per funzione con nome, numero di contatori e contatori
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+struct counters {
+  std::string name;
+  unsigned long long *c;
+  long long n;
+};
+
+std::vector<counters> &registered() {
+  static std::vector<counters> r;
+  return r;
+}
+
+void dump() {
+  if (registered().empty()) return;
+  const char *path = getenv("KPROFILE");
+  if (!path || !*path) path = "default.kprof";
+  std::map<std::string, std::vector<unsigned long long>> prof;
+  if (FILE *f = fopen(path, "r")) {
+    char name[4096];
+    long long n;
+    while (fscanf(f, "%4095s", name) == 1) {
+      if (name[0] == '#') {                 // Intestazione
+        fscanf(f, "%*[^\n]");
+        continue;
+      }
+      if (fscanf(f, "%lld", &n) != 1 || n < 0) break;
+      std::vector<unsigned long long> &v = prof[name];
+      v.assign(n, 0);
+      for (long long i = 0; i < n; i++)
+        if (fscanf(f, "%llu", &v[i]) != 1) break;
+    }
+    fclose(f);
+  }
+  // Una funzione il cui numero di contatori è cambiato (sorgente modificato)
+  // riparte da zero
+  for (const counters &r : registered()) {
+    std::vector<unsigned long long> &v = prof[r.name];
+    if ((long long) v.size() != r.n) v.assign(r.n, 0);
+    for (long long i = 0; i < r.n; i++) v[i] += r.c[i];
+  }
+  // Scrittura in un file temporaneo e rinomina: un'esecuzione interrotta non
+  // lascia un profilo troncato
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "kprofile: impossibile scrivere %s\n", tmp.c_str());
+    return;
+  }
+  fprintf(f, "# kprofile 1\n");
+  for (auto &p : prof) {
+    fprintf(f, "%s %zu", p.first.c_str(), p.second.size());
+    for (unsigned long long c : p.second) fprintf(f, " %llu", c);
+    fprintf(f, "\n");
+  }
+  if (fclose(f) != 0 || rename(tmp.c_str(), path) != 0)
+    fprintf(stderr, "kprofile: impossibile scrivere %s\n", path);
+  registered().clear();
+}
+}
+
+extern "C" void kprof_register(const char *name, unsigned long long *c, long long n) {
+  static bool first = true;
+  if (first)
+    atexit(dump);
+  first = false;
+  registered().push_back({name, c, n});
+}
+
+// Scrittura immediata del profilo, usata da kcomp --run prima che il JIT rilasci
+// la memoria dei contatori (dopo, l'uscita del processo non ha più nulla da scrivere)
+extern "C" void kprof_dump() {
+  dump();
+}
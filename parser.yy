@@ -10,6 +10,7 @@
 %code requires {
   #include <string>
   #include <exception>
+  #include "llvm/ADT/StringMap.h"
   class driver;
   class RootAST;
   class ExprAST;
@@ -21,6 +22,7 @@
   class PrototypeAST;
   class BlockExprAST;
   class VarBindingAST;
+  class ArrayBindingAST;
   class GlobalDeclAST;
   class AssignExprAST;
   class ArrayAccessExprAST;
@@ -29,6 +31,32 @@
   class ForExprAST;
   class UnaryExprAST;
   class IfExprAST;
+
+  // Tipi dei valori del linguaggio: double (predefinito) oppure int (intero a 64 bit)
+  enum class KType { Double, Int };
+
+  // Identificatore internato (si veda driver::intern): identificatori uguali hanno
+  // lo stesso symbol e si confrontano come puntatori, senza confrontare i caratteri;
+  // id() è un numero progressivo, l'indice del simbolo nelle tabelle del driver
+  class symbol {
+    const llvm::StringMapEntry<unsigned> *E = nullptr;
+  public:
+    symbol() = default;
+    explicit symbol(const llvm::StringMapEntry<unsigned> *E): E(E) {}
+    unsigned id() const { return E->getValue(); }
+    llvm::StringRef name() const { return E->getKey(); }
+    std::string str() const { return E->getKey().str(); }
+    bool operator==(symbol O) const { return E == O.E; }
+    bool operator!=(symbol O) const { return E != O.E; }
+    bool operator<(symbol O) const { return id() < O.id(); }
+  };
+
+  // Parametro di una funzione. Un parametro array (A[]) è passato per riferimento
+  struct KParam {
+    symbol Name;
+    KType T;
+    bool Array;
+  };
 }
 
 %param { driver& drv }
@@ -40,6 +68,21 @@
 
 %code {
 #include "driver.hpp"
+#include <chrono>
+
+// Il parser ottiene i token tramite questa funzione, che li conta e, se le
+// statistiche sono attive, misura il tempo trascorso nello scanner
+static yy::parser::symbol_type timed_yylex (driver& drv) {
+  drv.tokens++;
+  if (!drv.timing)
+    return yylex(drv);
+  auto start = std::chrono::steady_clock::now();
+  yy::parser::symbol_type tok = yylex(drv);
+  drv.scanwall += std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start).count();
+  return tok;
+}
+#define yylex timed_yylex
 }
 
 %define api.token.prefix {TOK_}
@@ -74,9 +117,10 @@
   NOT        "not"
   LBRACKET   "["
   RBRACKET   "]"
+  INT        "int"
 ;
 
-%token <std::string> IDENTIFIER "id"
+%token <symbol> IDENTIFIER "id"  // Internato dallo scanner
 %token <double> NUMBER "number"
 %token <long long> INTEGER "integer"
 
@@ -88,13 +132,15 @@
 %type <ExprAST*> blockexp
 %type <std::vector<ExprAST*>> optexp
 %type <std::vector<ExprAST*>> explist
-%type <RootAST*> program
+%type <std::vector<RootAST*>> program
 %type <RootAST*> top
 %type <FunctionAST*> definition
 %type <PrototypeAST*> external
 %type <PrototypeAST*> proto
-%type <std::vector<std::string>> idseq
+%type <std::vector<KParam>> idseq
+%type <KType> type
 %type <VarBindingAST*> binding
+%type <ArrayBindingAST*> arraybinding
 %type <RootAST*> stmt
 %type <ExprAST*> ifstmt
 %type <std::vector<RootAST*>> stmtlist
@@ -103,38 +149,61 @@
 %start startsymb;
 
 startsymb:
-  program                   { drv.root = $1; }
+  program                   { drv.root = drv.make<SeqAST>(std::move($1)); }
 
 program:
-  %empty                    { $$ = new SeqAST(nullptr,nullptr); }
-| top ";" program           { $$ = new SeqAST($1,$3); };
+  %empty                    { $$ = std::vector<RootAST*>(); }
+| program top ";"           {
+                                if ($2) {
+                                  $1.push_back($2);
+                                  drv.itemlocs.push_back(@2);
+                                }
+                                $$ = std::move($1);
+                              };
 
 top:
     %empty                                              { $$ = nullptr; }
   | definition                                          { $$ = $1; }
   | external                                            { $$ = $1; }
-  | GLOBAL IDENTIFIER                                   { $$ = new GlobalDeclAST($2, 0); }
-  | GLOBAL IDENTIFIER LBRACKET INTEGER RBRACKET     {
-                                                          if ($4 <= 0) {
+  | GLOBAL type IDENTIFIER                              { $$ = drv.make<GlobalDeclAST>($3, 0, $2); }
+  | GLOBAL type IDENTIFIER LBRACKET INTEGER RBRACKET  {
+                                                          if ($5 <= 0) {
                                                               yy::parser::error(drv.location, "La dimensione dell'array deve essere positiva.");
                                                               YYERROR;
                                                           }
-                                                          $$ = new GlobalDeclAST($2, static_cast<int>($4));
+                                                          $$ = drv.make<GlobalDeclAST>($3, static_cast<int>($5), $2);
+                                                      }
+  | exp                                               {
+                                                          // Nel REPL un'espressione viene valutata subito: diventa il
+                                                          // corpo di una funzione senza parametri, eseguita e rimossa
+                                                          if (!drv.interactive) {
+                                                              yy::parser::error(drv.location, "Espressione al livello più esterno ammessa solo con --repl");
+                                                              YYERROR;
+                                                          }
+                                                          PrototypeAST *P = drv.make<PrototypeAST>(drv.intern("__kcomp.expr"), std::vector<KParam>());
+                                                          $$ = drv.make<FunctionAST>(P, $1);
+                                                          P->noemit();
                                                       }
 ;
 
 definition:
-  DEF proto exp             { $$ = new FunctionAST($2,$3); $2->noemit(); };
+  DEF proto exp             { $$ = drv.make<FunctionAST>($2,$3); $2->noemit(); };
 
 external:
   EXTERN proto              { $$ = $2; };
 
 proto:
-  IDENTIFIER "(" idseq ")" { $$ = new PrototypeAST($1,$3);  };
+  type IDENTIFIER "(" idseq ")" { $$ = drv.make<PrototypeAST>($2,std::move($4),$1); };
 
 idseq:
-  %empty                    { std::vector<std::string> args; $$ = args; }
-| IDENTIFIER idseq          { $2.insert($2.begin(),$1); $$ = $2; };
+  %empty                    { $$ = std::vector<KParam>(); }
+| idseq type IDENTIFIER     { $1.push_back(KParam{$3, $2, false}); $$ = std::move($1); }
+| idseq type IDENTIFIER LBRACKET RBRACKET { $1.push_back(KParam{$3, $2, true}); $$ = std::move($1); };
+
+// Il tipo, se non indicato, è double
+type:
+  %empty                    { $$ = KType::Double; }
+| INT                       { $$ = KType::Int; drv.hasint = true; };
 
 %right ASSIGN;
 %right QMARK;
@@ -147,15 +216,16 @@ idseq:
 
 stmt:
   binding                   { $$ = (RootAST*)$1; }
+| arraybinding              { $$ = (RootAST*)$1; }
 | exp                       { $$ = (RootAST*)$1; }
 ;
 
 ifstmt:
   IF "(" exp ")" exp {
-    $$ = new IfStmtAST($3, $5, nullptr);
+    $$ = drv.make<IfStmtAST>($3, $5, nullptr);
   }
 | IF "(" exp ")" exp ELSE exp {
-    $$ = new IfStmtAST($3, $5, $7);
+    $$ = drv.make<IfStmtAST>($3, $5, $7);
   }
 ;
 
@@ -163,14 +233,14 @@ stmtlist:
   %empty                    { $$ = std::vector<RootAST*>(); }
 | stmt                      { $$ = std::vector<RootAST*>{ $1 }; }
 | stmtlist ";" stmt         {
-                                $$ = $1;
-                                $$.push_back($3);
+                                $1.push_back($3);
+                                $$ = std::move($1);
                               }
 ;
 
 exp:
-  IDENTIFIER ASSIGN exp                          { $$ = new AssignExprAST($1,$3); }
-| IDENTIFIER LBRACKET exp RBRACKET ASSIGN exp   { $$ = new ArrayAssignExprAST($1, $3, $6); }
+  IDENTIFIER ASSIGN exp                          { $$ = drv.make<AssignExprAST>($1,$3); }
+| IDENTIFIER LBRACKET exp RBRACKET ASSIGN exp   { $$ = drv.make<ArrayAssignExprAST>($1, $3, $6); }
 | simple_exp_terms                              { $$ = $1; }
 | expif                                         { $$ = $1; }
 | ifstmt                                        { $$ = $1; }
@@ -178,65 +248,66 @@ exp:
 ;
 
 simple_exp_terms:
-  NOT simple_exp_terms %prec NOT                 { $$ = new UnaryExprAST('!', $2); }
-| MINUS simple_exp_terms %prec UMINUS            { $$ = new UnaryExprAST('-', $2); }
-| PLUSPLUS simple_exp_terms %prec PLUSPLUS       { $$ = new UnaryExprAST('p', $2); }
-| MINUSMINUS simple_exp_terms %prec MINUSMINUS   { $$ = new UnaryExprAST('m', $2); }
-| simple_exp_terms PLUS simple_exp_terms  { $$ = new BinaryExprAST('+',$1,$3); }
-| simple_exp_terms MINUS simple_exp_terms { $$ = new BinaryExprAST('-',$1,$3); }
-| simple_exp_terms STAR simple_exp_terms  { $$ = new BinaryExprAST('*',$1,$3); }
-| simple_exp_terms SLASH simple_exp_terms { $$ = new BinaryExprAST('/',$1,$3); }
-| simple_exp_terms LT simple_exp_terms    { $$ = new BinaryExprAST('<',$1,$3); }
-| simple_exp_terms EQ simple_exp_terms    { $$ = new BinaryExprAST('=',$1,$3); }
-| simple_exp_terms AND simple_exp_terms   { $$ = new BinaryExprAST('a', $1, $3); }
-| simple_exp_terms OR simple_exp_terms    { $$ = new BinaryExprAST('o', $1, $3); }
+  NOT simple_exp_terms %prec NOT                 { $$ = drv.make<UnaryExprAST>('!', $2); }
+| MINUS simple_exp_terms %prec UMINUS            { $$ = drv.make<UnaryExprAST>('-', $2); }
+| PLUSPLUS simple_exp_terms %prec PLUSPLUS       { $$ = drv.make<UnaryExprAST>('p', $2); }
+| MINUSMINUS simple_exp_terms %prec MINUSMINUS   { $$ = drv.make<UnaryExprAST>('m', $2); }
+| simple_exp_terms PLUS simple_exp_terms  { $$ = drv.make<BinaryExprAST>('+',$1,$3); }
+| simple_exp_terms MINUS simple_exp_terms { $$ = drv.make<BinaryExprAST>('-',$1,$3); }
+| simple_exp_terms STAR simple_exp_terms  { $$ = drv.make<BinaryExprAST>('*',$1,$3); }
+| simple_exp_terms SLASH simple_exp_terms { $$ = drv.make<BinaryExprAST>('/',$1,$3); }
+| simple_exp_terms LT simple_exp_terms    { $$ = drv.make<BinaryExprAST>('<',$1,$3); }
+| simple_exp_terms EQ simple_exp_terms    { $$ = drv.make<BinaryExprAST>('=',$1,$3); }
+| simple_exp_terms AND simple_exp_terms   { $$ = drv.make<BinaryExprAST>('a', $1, $3); }
+| simple_exp_terms OR simple_exp_terms    { $$ = drv.make<BinaryExprAST>('o', $1, $3); }
 | idexp                               { $$ = $1; }
 | LPAREN exp RPAREN                   { $$ = $2; }
-| NUMBER                              { $$ = new NumberExprAST($1); }
-| INTEGER                             { $$ = new NumberExprAST(static_cast<double>($1)); }
+| NUMBER                              { $$ = drv.make<NumberExprAST>($1); }
+| INTEGER                             { $$ = drv.make<NumberExprAST>(static_cast<double>($1)); }
 | blockexp                            { $$ = $1; }
 ;
 
 blockexp:
-  LBRACE stmtlist ";" exp RBRACE  { $$ = new BlockExprAST($2, $4); }
+  LBRACE stmtlist ";" exp RBRACE  { $$ = drv.make<BlockExprAST>(std::move($2), $4); }
 | LBRACE exp RBRACE               {
                                     std::vector<RootAST*> empty;
-                                    $$ = new BlockExprAST(empty, $2);
+                                    $$ = drv.make<BlockExprAST>(empty, $2);
                                   }
-| LBRACE stmtlist RBRACE          { $$ = new BlockExprAST($2, new NumberExprAST(0.0)); }
+| LBRACE stmtlist RBRACE          { $$ = drv.make<BlockExprAST>(std::move($2), drv.make<NumberExprAST>(0.0)); }
 ;
 
 forexpr:
-  FOR LPAREN binding SEMICOLON exp SEMICOLON exp RPAREN exp { $$ = new ForExprAST($3, nullptr, $5, $7, $9); }
-| FOR LPAREN exp SEMICOLON exp SEMICOLON exp RPAREN exp    { $$ = new ForExprAST(nullptr, $3, $5, $7, $9); }
+  FOR LPAREN binding SEMICOLON exp SEMICOLON exp RPAREN exp { $$ = drv.make<ForExprAST>($3, nullptr, $5, $7, $9); }
+| FOR LPAREN exp SEMICOLON exp SEMICOLON exp RPAREN exp    { $$ = drv.make<ForExprAST>(nullptr, $3, $5, $7, $9); }
 ;
 
 binding:
-  VAR IDENTIFIER ASSIGN exp { $$ = new VarBindingAST($2,$4); }
-| VAR IDENTIFIER            { $$ = new VarBindingAST($2, nullptr); }
+  VAR type IDENTIFIER ASSIGN exp { $$ = drv.make<VarBindingAST>($3,$5,$2); }
+| VAR type IDENTIFIER            { $$ = drv.make<VarBindingAST>($3, nullptr,$2); }
+;
+
+// Array locale, di dimensione calcolata a tempo di esecuzione
+arraybinding:
+  VAR type IDENTIFIER LBRACKET exp RBRACKET { $$ = drv.make<ArrayBindingAST>($3, $5, $2); }
 ;
 
 expif:
-  exp QMARK exp COLON exp %prec QMARK { $$ = new IfExprAST($1,$3,$5); }
+  exp QMARK exp COLON exp %prec QMARK { $$ = drv.make<IfExprAST>($1,$3,$5); }
 ;
 
 idexp:
-  IDENTIFIER                          { $$ = new VariableExprAST($1); }
-| IDENTIFIER LPAREN optexp RPAREN     { $$ = new CallExprAST($1,$3); }
-| IDENTIFIER LBRACKET exp RBRACKET    { $$ = new ArrayAccessExprAST($1, $3); }
+  IDENTIFIER                          { $$ = drv.make<VariableExprAST>($1); }
+| IDENTIFIER LPAREN optexp RPAREN     { $$ = drv.make<CallExprAST>($1,std::move($3)); }
+| IDENTIFIER LBRACKET exp RBRACKET    { $$ = drv.make<ArrayAccessExprAST>($1, $3); }
 ;
 
 optexp:
-  %empty                    { std::vector<ExprAST*> args; $$ = args; }
-| explist                   { $$ = $1; };
+  %empty                    { $$ = std::vector<ExprAST*>(); }
+| explist                   { $$ = std::move($1); };
 
 explist:
-  exp                       {
-                                std::vector<ExprAST*> args;
-                                args.push_back($1);
-                                $$ = args;
-                              }
-| exp COMMA explist         { $3.insert($3.begin(), $1); $$ = $3; };
+  exp                       { $$ = std::vector<ExprAST*>{ $1 }; }
+| explist COMMA exp         { $1.push_back($3); $$ = std::move($1); };
 
 %%
 
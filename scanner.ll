@@ -85,8 +85,9 @@ blank   [ \t]
 "or"     { return yy::parser::make_OR(loc); }
 "and"    { return yy::parser::make_AND(loc); }
 "not"    { return yy::parser::make_NOT(loc); }
+"int"    { return yy::parser::make_INT(loc); }
 
-{id}     { return yy::parser::make_IDENTIFIER (yytext, loc); }
+{id}     { return yy::parser::make_IDENTIFIER (drv.intern (llvm::StringRef (yytext, yyleng)), loc); }
 
 .        { throw yy::parser::syntax_error
                (loc, "invalid character: " + std::string(yytext));
@@ -97,17 +98,24 @@ blank   [ \t]
 
 void driver::scan_begin () {
   yy_flex_debug = trace_scanning;
-  if (file.empty () || file == "-")
-    yyin = stdin;
-  else if (!(yyin = fopen (file.c_str (), "r")))
+  if (!source.empty ())        // Testo già in memoria (REPL, --incremental)
     {
-      std::cerr << "cannot open " << file << ": " << strerror(errno) << '\n';
+      yy_scan_bytes (source.data (), source.size ());
+      return;
+    }
+  std::error_code ec;
+  llvm::MutableArrayRef<char> text = read_input (ec);
+  if (ec)
+    {
+      std::cerr << "cannot open " << file << ": " << ec.message () << '\n';
       exit (EXIT_FAILURE);
     }
+  yy_scan_buffer (text.data (), text.size ());
 }
 
 void
 driver::scan_end ()
 {
-  fclose (yyin);
+  yy_delete_buffer (YY_CURRENT_BUFFER);
+  release_input ();
 }
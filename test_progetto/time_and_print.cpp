@@ -1,8 +1,13 @@
 #include <iostream>
 #include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 extern "C" {
     double timek();
+    double timens();
+    double cycles();
 }
 
 extern "C" {
@@ -14,6 +19,26 @@ double timek() {
     return t;
 }
 
+// Tempo monotono in nanosecondi, per misurare intervalli brevi
+double timens() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Contatore dei cicli della CPU (dove non è disponibile, nanosecondi)
+double cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    unsigned long v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return timens();
+#endif
+}
+
 double printval(double x, double controlchar) {
   if (controlchar==0) std::cout << x << std::endl;
   else std::cout << "--------------------\n---Array ordinato---\n--------------------\n";